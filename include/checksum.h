@@ -0,0 +1,17 @@
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#include "common.h"
+
+/**
+ * @brief Update a CRC32 (IEEE 802.3, reflected) state with more data, with
+ *        the best kernel supported by the running CPU
+ *
+ * @param crc Current CRC state (0xffffffff for a new checksum)
+ * @param data Data to add
+ * @param length Data length
+ * @return uint32_t Updated CRC state
+ */
+uint32_t checksum_update(uint32_t crc, const void *data, size_t length);
+
+#endif // __CHECKSUM_H__
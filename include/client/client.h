@@ -20,6 +20,19 @@ typedef enum
     INP_READ = 1        // Input read
 } fp_input_result;
 
+/**
+ * @brief Response to a query sent on a request channel
+ * 
+ */
+typedef struct
+{
+    char* query;        // Query arguments
+    download* file;     // Output file (client B)
+    char* response;     // Response waiting for its turn to be printed (client A)
+    size_t size;        // Bytes received
+    int done;           // Whole response received
+} channel_response;
+
 /**
  * @brief Client representation data
  * 
@@ -62,6 +75,45 @@ fp_input_result get_input(char* buffer, size_t buffer_size, FILE* fp);
  */
 void journalctl(void);
 
+/**
+ * @brief Send several queries separated by ';' at once on the request
+ *        channels of the connection. Client A prints the responses in
+ *        query order, the first one as it arrives and the others from
+ *        memory once their turn comes
+ * 
+ * @param buffer Queries
+ */
+void journalctl_channels(char* buffer);
+
+/**
+ * @brief Start the download a client B response is saved to
+ * 
+ * @param filename Output file name (256 bytes)
+ * @param channel Request channel, -1 without channels
+ * @return download* Output file, NULL if it could not be created
+ */
+download* response_file(char* filename, int channel);
+
+/**
+ * @brief Print part of a server response as it arrives (stream consumer)
+ * 
+ * @param context Not used
+ * @param data Response bytes
+ * @param size Number of bytes
+ * @return int 0 to continue
+ */
+int print_response(void* context, const char* data, size_t size);
+
+/**
+ * @brief Save part of a server response as it arrives (stream consumer)
+ * 
+ * @param context Output file (download*), NULL to discard the response
+ * @param data Response bytes
+ * @param size Number of bytes
+ * @return int 0 to continue, -1 if the file could not be written
+ */
+int save_response(void* context, const char* data, size_t size);
+
 /**
  * @brief Obtain server system info
  * 
@@ -3,6 +3,32 @@
 
 #include "common.h"
 
+// Bytes collected before each write to a download file (multiple of DOWNLOAD_ALIGNMENT)
+#define DOWNLOAD_BUFFER_SIZE (256 * 1024)
+
+// Alignment of the download buffer and of the file offsets written
+#define DOWNLOAD_ALIGNMENT 4096
+
+// Disk space reserved ahead of a growing download
+#define DOWNLOAD_RESERVE_STEP (8 * 1024 * 1024)
+
+/**
+ * @brief File written as a response arrives. It is written under a
+ *        temporary name and renamed once complete
+ * 
+ */
+typedef struct
+{
+    int fd;                     // Temporary file descriptor
+    char path[256];             // Final path
+    char temp_path[272];        // Temporary path
+    char* buffer;               // Bytes waiting to be written (DOWNLOAD_BUFFER_SIZE, aligned)
+    size_t buffered;            // Bytes in buffer
+    size_t size;                // Bytes written to the file
+    size_t reserved;            // Bytes reserved on disk, 0 if the file system cannot
+    int failed;                 // A write failed
+} download;
+
 /**
  * @brief Trim white space from string
  * 
@@ -11,4 +37,32 @@
  */
 char* trim_white_space(char* str);
 
+/**
+ * @brief Start a download to a file
+ * 
+ * @param path Final path of the file
+ * @return download* Download, NULL if the temporary file could not be created
+ */
+download* download_open(const char *path);
+
+/**
+ * @brief Add bytes to a download, written in whole aligned buffers
+ * 
+ * @param file Download
+ * @param data Bytes
+ * @param size Number of bytes
+ * @return int 0 if success, -1 if a write failed
+ */
+int download_write(download *file, const char *data, size_t size);
+
+/**
+ * @brief Finish a download and release it. A complete download is
+ *        renamed to its final path, otherwise the temporary file is removed
+ * 
+ * @param file Download
+ * @param complete 1 if the whole response was received
+ * @return int 0 if the file was saved, -1 otherwise
+ */
+int download_close(download *file, int complete);
+
 #endif // __CLIENT_UTILS_H__
\ No newline at end of file
@@ -6,6 +6,9 @@
 #include <sys/socket.h>
 #include <sys/sysinfo.h>
 #include <sys/select.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -17,6 +20,7 @@
 #include <zlib.h>
 #include <stdint.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 // Define colors codes for terminal
@@ -45,6 +49,7 @@
     #define ASCII_PERCENT       37      // '%'  
     #define ASCII_GREATER_THAN  62      // '>'  
     #define ASCII_LESS_THAN     60      // '<'  
+    #define ASCII_SEMICOLON     59      // ';'  
 #endif
 
 // Define macro to unused variables
@@ -73,7 +78,8 @@ typedef enum
     ERROR_SOCKET_RECEIVE = -7,      // Socket receive failed
     ERROR_THREAD_FAILED = -8,       // Thread creation failed
     ERROR_SOCKET_DISCONNECT = -9,   // Socket lost connection
-    END_SIGNAL = -10                // End signal received
+    END_SIGNAL = -10,               // End signal received
+    ERROR_FRAME_MALFORMED = -11     // Received frame is malformed
 } error_code;
 
 /**
@@ -95,7 +101,8 @@ typedef enum
 {
     SOCKECT_TYPE_UNIX,  // UNIX socket
     SOCKECT_TYPE_IPV4,  // IPV4 socket
-    SOCKECT_TYPE_IPV6   // IPV6 socket
+    SOCKECT_TYPE_IPV6,  // IPV6 socket
+    SOCKECT_TYPE_SHM    // Shared memory rings set up through the UNIX socket
 } sockect_type;
 
 // Aux array to convert client type to string
@@ -9,6 +9,257 @@
 // Max header size
 #define HEADER_SIZE 150
 
+// Max size of a connection options string
+#define CONNECTION_OPTIONS_SIZE 256
+
+// Default fragments in flight on binary connections
+#define CONNECTION_DEFAULT_WINDOW 16
+
+// Max fragments in flight on binary connections
+#define CONNECTION_MAX_WINDOW 1024
+
+// Min data bytes per fragment on binary connections
+#define CONNECTION_MIN_FRAGMENT_SIZE 512
+
+// Max data bytes per fragment on binary connections
+#define CONNECTION_MAX_FRAGMENT_SIZE (1024 * 1024)
+
+// Default data bytes per fragment on binary UNIX connections
+#define CONNECTION_UNIX_FRAGMENT_SIZE (128 * 1024)
+
+// Max data bytes in flight on binary connections (window times fragment size)
+#define CONNECTION_MAX_WINDOW_BYTES (16 * 1024 * 1024)
+
+// Default concurrent request channels on binary connections
+#define CONNECTION_DEFAULT_CHANNELS 8
+
+// Max concurrent request channels on binary connections
+#define CONNECTION_MAX_CHANNELS 64
+
+// zlib level of compressed connections
+#define CONNECTION_COMPRESSION_LEVEL 1
+
+// Bytes compressed or decompressed at once on compressed connections
+#define CONNECTION_COMPRESSION_CHUNK (64 * 1024)
+
+// Bytes of each shared memory ring of local connections (power of two)
+#define CONNECTION_RING_SIZE (4 * 1024 * 1024)
+
+/**
+ * @brief Wire formats of fragments
+ * 
+ */
+typedef enum
+{
+    WIRE_FORMAT_JSON,   // JSON object with decimal data array (legacy)
+    WIRE_FORMAT_BINARY  // Fixed binary header followed by raw data
+} wire_format;
+
+/**
+ * @brief How JSON fragments are delimited on the wire
+ * 
+ */
+typedef enum
+{
+    FRAMING_PADDED, // Every fragment padded to FRAGMENT_SIZE bytes (legacy)
+    FRAMING_LENGTH  // Every fragment preceded by its length
+} framing_mode;
+
+/**
+ * @brief Encoding of the data field of JSON fragments
+ * 
+ */
+typedef enum
+{
+    JSON_PAYLOAD_ARRAY,     // Array of decimal byte values (legacy)
+    JSON_PAYLOAD_BASE64     // Base64 string
+} json_payload;
+
+/**
+ * @brief Compression of the data sent on a connection
+ * 
+ */
+typedef enum
+{
+    COMPRESSION_NONE,   // Data sent as is
+    COMPRESSION_DEFLATE // One raw deflate stream per direction, flushed at the end of every message
+} compression_mode;
+
+/**
+ * @brief Transport of the bytes of a connection
+ * 
+ */
+typedef enum
+{
+    TRANSPORT_SOCKET,   // Bytes go through the socket
+    TRANSPORT_RING      // Bytes go through a pair of shared memory rings, the socket only signals the end
+} transport_mode;
+
+/**
+ * @brief Connection options negotiated at handshake
+ * 
+ */
+typedef struct
+{
+    wire_format format;           // Fragments wire format
+    uint32_t window;              // Fragments in flight before waiting for an acknowledgement
+    framing_mode framing;         // How JSON fragments are delimited
+    uint32_t fragment_size;       // Data bytes per binary fragment
+    uint32_t channels;            // Concurrent request channels, 0 without multiplexing
+    json_payload payload;         // Encoding of the data of JSON fragments
+    compression_mode compression; // Compression of the data sent
+    transport_mode transport;     // Transport of the bytes of the connection
+    uint32_t bulk;                // Smallest binary transfer passed as a memory file, 0 to always fragment
+} connection_options;
+
+/**
+ * @brief Stream producer, fills buffer with the next bytes of a stream
+ * 
+ * @param context Producer context
+ * @param buffer Output buffer
+ * @param size Output buffer size
+ * @return ssize_t Bytes produced, 0 at the end of the stream, -1 on error
+ */
+typedef ssize_t (*stream_producer)(void *context, char *buffer, size_t size);
+
+/**
+ * @brief Stream consumer, receives the bytes of a stream in order
+ * 
+ * @param context Consumer context
+ * @param data Next bytes of the stream
+ * @param size Number of bytes
+ * @return int 0 to continue, -1 to abort the transfer
+ */
+typedef int (*stream_consumer)(void *context, const char *data, size_t size);
+
+/**
+ * @brief Initialize connection options with the values supported by this build
+ * 
+ * The fragment size depends on the transport of the socket: UNIX sockets
+ * use CONNECTION_UNIX_FRAGMENT_SIZE, TCP sockets whole segments (MSS)
+ * so that a window of fragments fills the send buffer. Only TCP sockets
+ * offer compression and only UNIX sockets shared memory rings. Environment
+ * variables IPC_FORMAT ("json" or "binary"), IPC_WINDOW (fragments in
+ * flight), IPC_FRAGMENT_SIZE (data bytes per fragment), IPC_CHANNELS
+ * (concurrent request channels, 0 to disable), IPC_PAYLOAD ("base64"
+ * or "array", data of JSON fragments), IPC_COMPRESSION ("deflate" or
+ * "none") and IPC_TRANSPORT ("ring" or "socket") override the defaults.
+ * IPC_BULK (bytes) makes UNIX sockets off the io_uring backend offer
+ * bulk transfers of that size and up.
+ * 
+ * @param sockect_fd Connected socket the options are for, -1 for none
+ * @param options Options to initialize
+ */
+void connection_options_default(int sockect_fd, connection_options *options);
+
+/**
+ * @brief Initialize connection options with the legacy (pre-negotiation) values
+ * 
+ * @param options Options to initialize
+ */
+void connection_options_legacy(connection_options *options);
+
+/**
+ * @brief Parse connection options from a "key=value key=value" string
+ * 
+ * @param text Options string
+ * @param options Options to update (unknown keys are ignored)
+ * @return int Number of recognized options
+ */
+int connection_options_parse(const char *text, connection_options *options);
+
+/**
+ * @brief Format connection options as a "key=value key=value" string
+ * 
+ * @param options Options to format
+ * @param buffer Output buffer
+ * @param buffer_size Output buffer size
+ * @return size_t Length of the string written
+ */
+size_t connection_options_format(const connection_options *options, char *buffer, size_t buffer_size);
+
+/**
+ * @brief Agree options between a peer offer and the local capabilities
+ * 
+ * @param offer Options offered by peer
+ * @param local Options supported locally
+ * @param agreed Options to use on the connection
+ */
+void connection_options_negotiate(const connection_options *offer, const connection_options *local, connection_options *agreed);
+
+/**
+ * @brief Apply negotiated options to a connected socket
+ * 
+ * @param sockect_fd Socket file descriptor
+ * @param options Options to apply
+ * @return error_code Error code
+ */
+error_code connection_configure(int sockect_fd, const connection_options *options);
+
+/**
+ * @brief Release the state of a socket, call before closing it
+ * 
+ * @param sockect_fd Socket file descriptor
+ */
+void connection_release(int sockect_fd);
+
+/**
+ * @brief Release the read-ahead buffer of a connection that waits for its
+ *        next request. Bytes already read ahead are kept: the socket will
+ *        not become readable for them
+ * 
+ * @param sockect_fd Socket file descriptor
+ * @return int 1 if bytes were read ahead and the next request can be read
+ *         right away, 0 otherwise
+ */
+int connection_idle(int sockect_fd);
+
+/**
+ * @brief Check whether polling the socket of a connection tells when its
+ *        next request arrives. Shared memory rings and io_uring receives
+ *        take the bytes elsewhere
+ * 
+ * @param sockect_fd Socket file descriptor
+ * @return int 1 if the socket shows the readiness of the connection
+ */
+int connection_pollable(int sockect_fd);
+
+/**
+ * @brief Create the shared memory rings of a configured UNIX connection and
+ *        pass them to the peer, which must call connection_ring_attach.
+ *        From then on every byte of the connection goes through the rings
+ * 
+ * @param sockect_fd Socket file descriptor
+ * @return error_code Error code
+ */
+error_code connection_ring_create(int sockect_fd);
+
+/**
+ * @brief Receive and map the shared memory rings created by the peer with
+ *        connection_ring_create
+ * 
+ * @param sockect_fd Socket file descriptor
+ * @return error_code Error code
+ */
+error_code connection_ring_attach(int sockect_fd);
+
+/**
+ * @brief Wake up every wait of the communication API so it checks its end
+ *        flag. Async-signal-safe, call it from a signal handler after
+ *        setting the flag. The wakeup is permanent: every later wait with
+ *        an end flag returns as soon as it finds the flag set
+ * 
+ */
+void communication_wakeup(void);
+
+/**
+ * @brief Get the descriptor that becomes readable on communication_wakeup,
+ *        for callers that wait on their own descriptors
+ * 
+ * @return int Event file descriptor, -1 if it could not be created
+ */
+int communication_wakeup_fd(void);
+
 /**
  * @brief Receive data from socket
  * 
@@ -31,4 +282,88 @@ error_code receive_data(int sockect_fd, char **buffer, size_t* bytes_received, v
  */
 error_code send_data(int sockect_fd, char *data, size_t data_size, volatile sig_atomic_t *end_flag);
 
+/**
+ * @brief Receive data from socket as it arrives
+ * 
+ * Fragments are passed to the consumer in order, so memory use is bounded
+ * by the connection window whatever the message size. Any message can be
+ * received this way, whether it was sent with send_data or send_stream. If
+ * the consumer aborts, the connection is left in an unknown state and must
+ * be closed.
+ * 
+ * @param sockect_fd Socket file descriptor
+ * @param consumer Consumer of received data
+ * @param context Consumer context
+ * @param bytes_received Bytes received
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+error_code receive_stream(int sockect_fd, stream_consumer consumer, void *context, size_t* bytes_received, volatile sig_atomic_t *end_flag);
+
+/**
+ * @brief Send data to socket as it is produced
+ * 
+ * The producer is called for at most one fragment at a time and its output
+ * is sent right away, so the size of the stream does not need to be known
+ * in advance. The receiver may use receive_data or receive_stream. If the
+ * producer fails, the stream is ended and ERROR_SOCKET_SEND is returned.
+ * 
+ * @param sockect_fd Socket file descriptor
+ * @param producer Producer of data to send
+ * @param context Producer context
+ * @param bytes_sent Bytes sent
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+error_code send_stream(int sockect_fd, stream_producer producer, void *context, size_t* bytes_sent, volatile sig_atomic_t *end_flag);
+
+/**
+ * @brief Get the number of request channels negotiated on a socket
+ * 
+ * @param sockect_fd Socket file descriptor
+ * @return uint32_t Concurrent request channels, 0 if the connection is not multiplexed
+ */
+uint32_t channel_count(int sockect_fd);
+
+/**
+ * @brief Send a whole message on a request channel. Every fragment is
+ *        written at once, so messages of other channels sent from other
+ *        threads interleave with it fragment by fragment
+ * 
+ * @param sockect_fd Socket file descriptor
+ * @param channel Channel (below channel_count)
+ * @param data Data to send
+ * @param data_size Data size
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+error_code channel_send(int sockect_fd, uint32_t channel, const char *data, size_t data_size, volatile sig_atomic_t *end_flag);
+
+/**
+ * @brief Send data on a request channel as it is produced
+ * 
+ * @param sockect_fd Socket file descriptor
+ * @param channel Channel (below channel_count)
+ * @param producer Producer of data to send
+ * @param context Producer context
+ * @param bytes_sent Bytes sent
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+error_code channel_send_stream(int sockect_fd, uint32_t channel, stream_producer producer, void *context, size_t *bytes_sent, volatile sig_atomic_t *end_flag);
+
+/**
+ * @brief Receive the next fragment of any request channel. Only one
+ *        thread may receive from a socket at a time
+ * 
+ * @param sockect_fd Socket file descriptor
+ * @param channel Channel of the fragment
+ * @param data Fragment data (NUL terminated, free after use)
+ * @param data_size Fragment size
+ * @param last 1 if the fragment ends the message of its channel
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+error_code channel_receive(int sockect_fd, uint32_t *channel, char **data, size_t *data_size, int *last, volatile sig_atomic_t *end_flag);
+
 #endif //__COMMUNICATION_API_H__
\ No newline at end of file
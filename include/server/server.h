@@ -2,8 +2,36 @@
 #define __SERVER_H__
 
 #include "server_threads_handle.h"
+#include "server_pool.h"
 #include "server_utils.h"
 #include "communication_api.h"
+#include "uring.h"
+
+#include <sys/epoll.h>
+
+// Events taken from the event loop at once
+#define EVENT_LOOP_EVENTS 64
+
+// Connections each listening socket queues until accepted (IPC_BACKLOG overrides it)
+#define SERVER_BACKLOG SOMAXCONN
+
+// Most acceptors, the event loop included (IPC_ACCEPTORS)
+#define SERVER_MAX_ACCEPTORS 64
+
+// Seconds a pooled client may keep a worker waiting on one receive or send (IPC_IO_TIMEOUT overrides it, 0 for none)
+#define SERVER_IO_TIMEOUT 5
+
+/**
+ * @brief Acceptor thread with IPV4 and IPV6 listening sockets of its own,
+ *        bound to the server ports along with those of the other acceptors
+ * 
+ */
+typedef struct
+{
+    pthread_t tid;          // Acceptor thread
+    int ipv4_socket_fd;     // IPV4 socket file descriptor
+    int ipv6_socket_fd;     // IPV6 socket file descriptor
+} acceptor;
 
 /**
  * @brief Server representation data
@@ -15,11 +43,59 @@ struct
     int unix_socket_fd;     // UNIX socket file descriptor
     int ipv4_socket_fd;     // IPV4 socket file descriptor
     int ipv6_socket_fd;     // IPV6 socket file descriptor
+    uring accept_ring;      // Multishot accepts of the listening sockets (fd -1 without io_uring)
+    int epoll_fd;           // Event loop of the listening sockets and idle clients
+    worker_pool pool;       // Workers serving the handshakes and receiving the requests
+    int commands;           // Command threads running (guarded by mutex)
+    int backlog;            // Backlog of the listening sockets
+    int io_timeout;         // Receive and send timeout of pooled clients, in seconds (0 for none)
+    acceptor* acceptors;    // Acceptor threads besides the event loop
+    int acceptor_count;     // Number of acceptor threads
 } server;
 
 // Flag to indicate if server is finished
 extern volatile sig_atomic_t finished;
 
+/**
+ * @brief Request of a channel of a multiplexed connection
+ * 
+ */
+typedef struct
+{
+    char* command;          // Command arguments received so far
+    size_t command_size;    // Bytes of command received
+    int active;             // A command thread answers on the channel (guarded by the session lock)
+    int queued;             // Command complete, waiting for the running one to end (guarded by the session lock)
+} channel_request;
+
+/**
+ * @brief Client connection. Between requests only the event loop watches
+ *        it, a pool worker serves it when a request arrives and the answer
+ *        is streamed by a command thread
+ * 
+ */
+typedef struct client_session
+{
+    int client_fd;                  // Client file descriptor
+    int type;                       // Client type, -1 until the handshake is done
+    channel_request* requests;      // Requests of the channels (CONNECTION_MAX_CHANNELS), NULL without channels
+    int handler;                    // Handler of the connection in the handler registry
+    pthread_mutex_t lock;           // Lock of the channel commands
+    int commands;                   // Channel commands running
+    int closing;                    // Session ended, the last channel command releases it
+} client_session;
+
+/**
+ * @brief Command streamed to a client by a thread of its own
+ * 
+ */
+typedef struct
+{
+    client_session* session;    // Session of the client
+    int channel;                // Request channel, -1 on connections without channels
+    char* command;              // Command arguments
+} command_task;
+
 /**
  * @brief Signal handler
  * 
@@ -36,32 +112,198 @@ void signal_handler(int sig, siginfo_t *info, void* context);
 void signal_handler_init(void);
 
 /**
- * @brief Handle request of clients type A
+ * @brief Stream the output of a journalctl command to a client
  * 
  * @param client_fd Client file descriptor
+ * @param channel Request channel, -1 on connections without channels
+ * @param type Client type
+ * @param command Command arguments
+ * @param compress Compress output with gzip
+ * @param handler Handler of the client connection
  */
-void client_a_handle(int client_fd);
+void journalctl_send(int client_fd, int channel, client_type type, const char* command, int compress, int handler);
 
 /**
- * @brief Handle request of clients type B
+ * @brief Stream the answer of a command, then the next request of its
+ *        channel if one arrived meanwhile. Without channels the session
+ *        is given back afterwards (session_resume)
+ * 
+ * @param task Command
+ */
+void command_run(command_task *task);
+
+/**
+ * @brief Run a command and release it (command thread entry point)
+ * 
+ * @param args Command (command_task), allocated
+ */
+void *command_thread(void *args);
+
+/**
+ * @brief Stream the answer of a request on a detached thread of its own,
+ *        so a long running command holds no pool worker. The command runs
+ *        on the caller if the thread is not started
+ * 
+ * @param session Session of the client
+ * @param channel Request channel, -1 on connections without channels
+ * @param command Command arguments, released by the command
+ */
+void command_start(client_session *session, int channel, char *command);
+
+/**
+ * @brief Receive the next fragment of a multiplexed client and start the
+ *        command once the request is complete. A request for a channel
+ *        still answering waits for the running command, which runs it next
+ * 
+ * @param session Session of the client
+ * @return error_code Error code
+ */
+error_code client_channel_receive(client_session *session);
+
+/**
+ * @brief Release the requests of a multiplexed client, once no command
+ *        runs on them
+ * 
+ * @param requests Requests of the channels (CONNECTION_MAX_CHANNELS)
+ */
+void client_channels_finish(channel_request *requests);
+
+/**
+ * @brief Handle the requests of a multiplexed client, every request runs on
+ *        a command thread and answers on the channel it arrived on
+ * 
+ * @param session Session of the client
+ */
+void client_channels_handle(client_session *session);
+
+/**
+ * @brief Receive one request of a client type A or B
  * 
  * @param client_fd Client file descriptor
+ * @param type Client type
+ * @param handler Handler of the client connection
+ * @param command Command arguments received, to release by the caller
+ * @return error_code Error code
  */
-void client_b_handle(int client_fd);
+error_code client_request_receive(int client_fd, client_type type, int handler, char **command);
+
+/**
+ * @brief Receive one request of a client type A or B and stream its answer
+ * 
+ * @param client_fd Client file descriptor
+ * @param type Client type
+ * @param handler Handler of the client connection
+ * @return error_code Error code of the request reception
+ */
+error_code client_request_handle(int client_fd, client_type type, int handler);
+
+/**
+ * @brief Handle request of clients type A
+ * 
+ * @param session Session of the client
+ */
+void client_a_handle(client_session *session);
+
+/**
+ * @brief Handle request of clients type B
+ * 
+ * @param session Session of the client
+ */
+void client_b_handle(client_session *session);
 
 /**
  * @brief Handle request of clients type C
  * 
  * @param client_fd Client file descriptor
+ * @param handler Handler of the client connection
  */
-void client_c_handle(int client_fd);
+void client_c_handle(int client_fd, int handler);
 
 /**
- * @brief Create and asign new handle thread for a new client
+ * @brief Set the receive and send timeouts of a client socket. A client
+ *        that stalls in the middle of a message then fails the receive or
+ *        send and is closed, instead of holding a pool worker
  * 
- * @param args Client file descriptor
+ * @param client_fd Client file descriptor
+ * @param seconds Timeout in seconds, 0 for none
  */
-void *connection_handler(void *args);
+void session_timeout_set(int client_fd, int seconds);
+
+/**
+ * @brief Open a session for a new client and hand it to the event loop
+ * 
+ * @param client_fd Client file descriptor
+ */
+void session_create(int client_fd);
+
+/**
+ * @brief Close a session and its connection. While channel commands still
+ *        run, the socket is shut down to stop them and the last one
+ *        releases the session
+ * 
+ * @param session Session
+ */
+void session_end(client_session *session);
+
+/**
+ * @brief Release a session no command runs on anymore and close its
+ *        connection
+ * 
+ * @param session Session
+ */
+void session_release(client_session *session);
+
+/**
+ * @brief Report the counters of a session still open and close it (handler
+ *        visitor, used when the server ends)
+ * 
+ * @param h Handler of the session
+ * @param args Unused
+ */
+void session_close(handler *h, void *args);
+
+/**
+ * @brief Queue a session whose socket is readable on the worker pool
+ * 
+ * @param session Session
+ */
+void session_dispatch(client_session *session);
+
+/**
+ * @brief Hand a session to a thread of its own, kept in the handler of the
+ *        session. The thread waits for its client without timeouts
+ * 
+ * @param session Session
+ */
+void session_thread_start(client_session *session);
+
+/**
+ * @brief Serve a session until it ends (session thread entry point)
+ * 
+ * @param args Session (client_session)
+ */
+void *session_thread(void *args);
+
+/**
+ * @brief Serve a session (pool task): complete the handshake or receive
+ *        one request and start its command, then give the session back
+ *        (session_resume). Without channels the command thread gives it
+ *        back once the answer was sent. Client C sessions are served until
+ *        they end, those whose socket does not show their input (shared
+ *        memory, io_uring) move to a thread of their own
+ * 
+ * @param args Session (client_session)
+ */
+void session_handler(void *args);
+
+/**
+ * @brief Give a served session back: queue it again if the next request
+ *        was already read, hand it to the event loop otherwise, or end it
+ * 
+ * @param session Session
+ * @param result Result of the request served
+ */
+void session_resume(client_session *session, error_code result);
 
 /**
  * @brief Start new connection with client
@@ -77,7 +319,7 @@ int connection_start(int client_fd);
  * @param client_fd Client file descriptor
  * @param type Client type
  */
-void connection_end(int *client_fd, client_type type);
+void connection_end(int client_fd, client_type type);
 
 /**
  * @brief Create UNIX server socket
@@ -88,28 +330,100 @@ void connection_end(int *client_fd, client_type type);
 error_code create_unix_socket(const char *socket_path);
 
 /**
- * @brief Create IPV4 server socket
+ * @brief Create IPV4 server socket, sharing its port with the other
+ *        acceptors (SO_REUSEPORT)
  * 
  * @param socket_port Socket port
+ * @param socket_fd Socket file descriptor created
  * @return error_code Error code
  */
-error_code create_ipv4_socket(const uint16_t socket_port);
+error_code create_ipv4_socket(const uint16_t socket_port, int *socket_fd);
 
 /**
- * @brief Create IPV6 server socket
+ * @brief Create IPV6 server socket, sharing its port with the other
+ *        acceptors (SO_REUSEPORT)
  * 
  * @param socket_port Socket port
+ * @param socket_fd Socket file descriptor created
  * @return error_code Error code
  */
-error_code create_ipv6_socket(const uint16_t socket_port);
+error_code create_ipv6_socket(const uint16_t socket_port, int *socket_fd);
 
 /**
- * @brief Accept new client connection
+ * @brief Accept the clients waiting on the multishot accepts of the
+ *        io_uring backend
+ * 
+ */
+void accept_pending_ring(void);
+
+/**
+ * @brief Accept the clients waiting on a listening socket
+ * 
+ * @param listen_fd Listening socket file descriptor (non-blocking)
+ */
+void accept_pending(int listen_fd);
+
+/**
+ * @brief Accept clients on the listening sockets of an acceptor until the
+ *        server ends (acceptor thread entry point)
+ * 
+ * @param args Acceptor (acceptor)
+ */
+void *acceptor_handler(void *args);
+
+/**
+ * @brief Get the number of acceptors to run: IPC_ACCEPTORS if set,
+ *        otherwise one per online processor
+ * 
+ * @return uint32_t Number of acceptors, the event loop included
+ */
+uint32_t acceptor_default_count(void);
+
+/**
+ * @brief Get the backlog of the listening sockets: IPC_BACKLOG if set,
+ *        otherwise SERVER_BACKLOG
+ * 
+ * @return int Backlog
+ */
+int server_backlog(void);
+
+/**
+ * @brief Get the receive and send timeout of pooled clients: IPC_IO_TIMEOUT
+ *        if set, otherwise SERVER_IO_TIMEOUT
+ * 
+ * @return int Timeout in seconds, 0 for none
+ */
+int server_io_timeout(void);
+
+/**
+ * @brief Start the acceptor threads, the event loop being the first
+ *        acceptor
+ * 
+ * @param count Number of acceptors, the event loop included
+ * @return error_code Error code
+ */
+error_code acceptors_start(uint32_t count);
+
+/**
+ * @brief Wait for the acceptor threads to end and close their sockets
+ * 
+ */
+void acceptors_stop(void);
+
+/**
+ * @brief Create the event loop and register the listening sockets (or
+ *        the multishot accepts) and the wakeup descriptor
  * 
- * @param client_fd Client file descriptor
  * @return error_code Error code
  */
-error_code accept_connection(int *client_fd);
+error_code event_loop_init(void);
+
+/**
+ * @brief Run the event loop until the server ends: accept clients and
+ *        queue sessions whose requests arrived on the worker pool
+ * 
+ */
+void event_loop(void);
 
 /**
  * @brief Initialize server
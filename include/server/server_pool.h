@@ -0,0 +1,117 @@
+#ifndef __SERVER_POOL_H__
+#define __SERVER_POOL_H__
+
+#include "common.h"
+
+// Tasks a worker queue holds before it grows
+#define POOL_QUEUE_SIZE 64
+
+// Most worker threads of a pool
+#define POOL_MAX_WORKERS 256
+
+struct worker_pool;
+
+/**
+ * @brief Task run by a pool worker
+ *
+ */
+typedef struct
+{
+    void (*run)(void*);     // Task function
+    void* args;             // Argument of the task function
+} pool_task;
+
+/**
+ * @brief Worker thread of a pool and its task queue. The worker takes the
+ *        oldest task of its queue, idle workers steal the newest one
+ *
+ */
+typedef struct
+{
+    struct worker_pool* pool; // Pool of the worker
+    uint32_t index;           // Position of the worker in the pool
+    pthread_t tid;            // Worker thread
+    pthread_mutex_t lock;     // Lock of the queue
+    pool_task* tasks;         // Queue ring (capacity a power of two)
+    size_t capacity;          // Tasks the ring holds
+    size_t head;              // Oldest task
+    size_t tail;              // Next free slot
+    uint64_t executed;        // Tasks run by this worker
+    uint64_t stolen;          // Tasks this worker took from other queues
+    size_t depth_max;         // Most tasks queued at once
+} pool_worker;
+
+/**
+ * @brief Fixed set of worker threads, each with its own queue
+ *
+ */
+typedef struct worker_pool
+{
+    pool_worker* workers;   // Workers
+    uint32_t count;         // Number of workers
+    uint32_t next;          // Queue of the next task submitted from outside the pool
+    size_t pending;         // Tasks queued and not taken yet
+    uint64_t submitted;     // Tasks submitted
+    int stop;               // Workers exit once the queues are empty
+    pthread_mutex_t lock;   // Lock of the sleeping workers
+    pthread_cond_t wake;    // Signaled when a task is queued or the pool stops
+} worker_pool;
+
+/**
+ * @brief Pool counters
+ *
+ */
+typedef struct
+{
+    uint32_t workers;       // Number of workers
+    uint64_t submitted;     // Tasks submitted
+    uint64_t executed;      // Tasks run
+    uint64_t stolen;        // Tasks run by a worker other than the one they were queued on
+    size_t depth;           // Tasks queued now
+    size_t depth_max;       // Most tasks queued at once on one worker
+} pool_stats;
+
+/**
+ * @brief Get the number of workers to start: IPC_WORKERS if set, otherwise
+ *        one per online processor
+ *
+ * @return uint32_t Number of workers
+ */
+uint32_t pool_default_size(void);
+
+/**
+ * @brief Start the workers of a pool
+ *
+ * @param pool Pool
+ * @param workers Number of workers (1 to POOL_MAX_WORKERS)
+ * @return error_code Error code
+ */
+error_code pool_init(worker_pool *pool, uint32_t workers);
+
+/**
+ * @brief Queue a task. Workers queue on their own queue, other threads
+ *        on each worker in turn
+ *
+ * @param pool Pool
+ * @param run Task function
+ * @param args Argument of the task function
+ * @return error_code Error code
+ */
+error_code pool_submit(worker_pool *pool, void (*run)(void*), void *args);
+
+/**
+ * @brief Read the counters of a pool
+ *
+ * @param pool Pool
+ * @param stats Counters
+ */
+void pool_stats_get(worker_pool *pool, pool_stats *stats);
+
+/**
+ * @brief Run every queued task, stop the workers and release the pool
+ *
+ * @param pool Pool
+ */
+void pool_destroy(worker_pool *pool);
+
+#endif // __SERVER_POOL_H__
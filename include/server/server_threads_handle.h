@@ -3,51 +3,91 @@
 
 #include "common.h"
 
+#include <time.h>
+
+// Handler slots allocated at once
+#define HANDLER_CHUNK_SIZE 1024
+
+// Most handler chunks (HANDLER_CHUNK_SIZE slots each)
+#define HANDLER_CHUNKS 1024
+
 /**
- * @brief Create new handle thread for a new client
- * 
+ * @brief Handler of a client connection, one slot of the handler registry
+ *
  */
-pthread_t* handler_create(void);
+typedef struct
+{
+    int used;                   // Slot holds a connection
+    int client_fd;              // Client file descriptor
+    int type;                   // Client type, -1 until the handshake is done
+    time_t start;               // Time the connection was accepted
+    uint64_t bytes_received;    // Bytes of requests received
+    uint64_t bytes_sent;        // Bytes of answers sent
+    pthread_t tid;              // Thread of its own
+    int thread;                 // tid holds a thread to join when the server ends
+    void* context;              // Owner of the handler (client session)
+    int next_free;              // Next free slot
+} handler;
 
 /**
- * @brief Destroy a handle thread
- * 
- * @param tid Thread id
+ * @brief Register a new client connection, reusing a free slot if any
+ *
+ * @param client_fd Client file descriptor
+ * @param context Owner of the handler
+ * @return int Handler id, -1 if the registry is full
  */
-void handler_destroy(pthread_t tid);
+int handler_create(int client_fd, void *context);
 
 /**
- * @brief Destroy all handle threads
- * 
+ * @brief Get a handler
+ *
+ * @param id Handler id
+ * @return handler* Handler
  */
-void handler_destroy_all(void);
+handler* handler_get(int id);
 
 /**
- * @brief Get last handle thread in list
- * 
- * @return struct th_node* Last handle thread
+ * @brief Free the slot of a handler
+ *
+ * @param id Handler id
  */
-struct th_node* handler_get_last(void);
+void handler_destroy(int id);
 
 /**
- * @brief Get handle thread by thread id
- * 
- * @param tid Thread id
- * @return struct th_node* Handle thread
+ * @brief Add to the byte counters of a handler
+ *
+ * @param id Handler id
+ * @param received Bytes received
+ * @param sent Bytes sent
  */
-struct th_node* handler_get_by_tid(pthread_t tid);
+void handler_account(int id, size_t received, size_t sent);
 
 /**
- * @brief Get handle thread parent
- * 
- * @param th Handle thread
- * @return struct th_node* Parent handle thread
+ * @brief Get the number of handlers registered
+ *
+ * @return int Handlers registered
  */
-struct th_node* handler_get_parent(struct th_node* th);
+int handler_count(void);
+
+/**
+ * @brief Visit every handler registered, without locks. Handlers may be
+ *        created and destroyed meanwhile: those are visited or not, and a
+ *        slot reused meanwhile may show the new connection
+ *
+ * @param visit Function called with each handler
+ * @param args Argument passed to visit
+ */
+void handler_foreach(void (*visit)(handler*, void*), void *args);
+
+/**
+ * @brief Free the registry
+ *
+ */
+void handler_destroy_all(void);
 
 /**
- * @brief Wait for all handle threads to finish
- * 
+ * @brief Wait for the threads of all handlers to finish
+ *
  */
 void handler_wait_all(void);
 
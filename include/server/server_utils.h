@@ -2,15 +2,54 @@
 #define __SERVER_UTILS_H__
 
 #include "common.h"
+#include "communication_api.h"
 
-// Joutnalctl temporary file path to save error
-#define JOURNAL_TMP_ERROR "tmp/err"
+#include <spawn.h>
+#include <sys/wait.h>
 
-// Joutnalctl temporary file path to save output
-#define JOURNAL_TMP_OUTPUT "tmp/out"
+// Shell that runs journalctl commands
+#define JOURNAL_SHELL "/bin/sh"
 
-// Joutnalctl temporary file path to save compression result
-#define COMPRESS_TMP_OUTPUT "tmp/compress"
+// Most bytes of standard error kept, the rest is dropped
+#define JOURNAL_ERROR_SIZE 65536
+
+// Journalctl output read at once
+#define JOURNAL_CHUNK_SIZE 4096
+
+/**
+ * @brief Journalctl output sources, in the order they are sent
+ * 
+ */
+typedef enum
+{
+    JOURNAL_OUTPUT,     // Standard output
+    JOURNAL_ERROR,      // Standard error (only if there was no output)
+    JOURNAL_TERMINATOR, // End of string
+    JOURNAL_END         // Nothing left
+} journal_source;
+
+/**
+ * @brief Journalctl execution streamed to a client
+ * 
+ */
+typedef struct
+{
+    pid_t pid;                              // Shell running the command, -1 once waited for
+    int output_fd;                          // Standard output pipe (non-blocking), -1 once closed
+    int error_fd;                           // Standard error pipe (non-blocking), -1 once closed
+    char* error;                            // Standard error received
+    size_t error_size;                      // Bytes of standard error received
+    size_t error_sent;                      // Bytes of standard error sent
+    size_t output_size;                     // Bytes read from standard output
+    journal_source source;                  // Source being read
+    int compress;                           // Compress output with gzip
+    int client_fd;                          // Client socket, reading stops once it hangs up (-1 if none)
+    volatile sig_atomic_t* end_flag;        // Stop reading once set (NULL if none)
+    z_stream gzip;                          // Compression stream
+    int input_done;                         // All output passed to the compression stream
+    int gzip_done;                          // Compression stream finished
+    Bytef input[JOURNAL_CHUNK_SIZE];        // Output waiting to be compressed
+} journalctl_stream;
 
 /**
  * @brief Get system information
@@ -20,29 +59,41 @@
 char* get_system_info(void);
 
 /**
- * @brief Compress and save data
+ * @brief Start a journalctl command whose output will be streamed. The
+ *        shell is spawned in a process group of its own, with its standard
+ *        output and error on pipes and its standard input on /dev/null
  * 
- * @param data Data to compress
- * @param filename File name
- * @return int Compression result. 0 if success, -1 if error
+ * @param stream Stream to initialize
+ * @param command Command arguments
+ * @param compress Compress output with gzip
+ * @param client_fd Client socket, reading stops with an error once it
+ *        hangs up or is shut down (-1 if none)
+ * @param end_flag Reading stops with an error once set (NULL if none)
+ * @return int 0 if success, -1 if error (errno set)
  */
-int compress_and_save_data(const char *data, const char* filename);
+int journalctl_open(journalctl_stream *stream, const char *command, int compress, int client_fd, volatile sig_atomic_t *end_flag);
 
 /**
- * @brief Execute journalctl command
+ * @brief Read the next bytes of a journalctl command (stream producer)
+ * 
+ * Standard output is sent as it is produced, while standard error is
+ * collected in memory. If the command writes nothing to its standard
+ * output, its standard error is sent instead. Uncompressed output ends
+ * with a NUL terminator.
  * 
- * @param command Command to execute
- * @param client_fd Executor client file descriptor
- * @return char* Result
+ * @param context Stream (journalctl_stream)
+ * @param buffer Output buffer
+ * @param size Output buffer size
+ * @return ssize_t Bytes read, 0 at the end, -1 if error
  */
-char* journalctl_execute(const char* command, int client_fd);
+ssize_t journalctl_read(void *context, char *buffer, size_t size);
 
 /**
- * @brief Read file
+ * @brief Finish a journalctl command and release its resources. A command
+ *        still running gets SIGTERM before it is waited for
  * 
- * @param file File path
- * @return char* File content
+ * @param stream Stream
  */
-char* read_file(const char* file);
+void journalctl_close(journalctl_stream *stream);
 
 #endif // __SERVER_UTILS_H__
\ No newline at end of file
@@ -0,0 +1,168 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "common.h"
+
+// Completion carries a provided buffer (IORING_CQE_F_BUFFER)
+#define URING_CQE_BUFFER (1U << 0)
+
+// More completions follow for the same entry (IORING_CQE_F_MORE)
+#define URING_CQE_MORE (1U << 1)
+
+// Shift of the provided buffer id in completion flags
+#define URING_CQE_BUFFER_SHIFT 16
+
+/**
+ * @brief io_uring instance: submission and completion rings shared with
+ *        the kernel and, optionally, a ring of provided receive buffers
+ *
+ */
+typedef struct
+{
+    int fd;                     // io_uring descriptor, -1 if not set up
+    void* sq_memory;            // Mapped submission ring
+    size_t sq_memory_size;      // Size of the submission ring mapping
+    void* cq_memory;            // Mapped completion ring (same as sq_memory on single mmap kernels)
+    size_t cq_memory_size;      // Size of the completion ring mapping
+    void* sqes;                 // Mapped submission entries
+    size_t sqes_size;           // Size of the submission entries mapping
+    uint32_t* sq_head;          // Submission head (kernel)
+    uint32_t* sq_tail;          // Submission tail (us)
+    uint32_t* sq_array;         // Submission index array
+    uint32_t sq_mask;           // Submission ring mask
+    uint32_t sq_entries;        // Submission ring entries
+    uint32_t* cq_head;          // Completion head (us)
+    uint32_t* cq_tail;          // Completion tail (kernel)
+    void* cqes;                 // Completion entries
+    uint32_t cq_mask;           // Completion ring mask
+    uint32_t queued;            // Entries written and not submitted yet
+    void* buffer_ring;          // Provided buffer ring, NULL if none
+    char* buffers;              // Memory of the provided buffers
+    uint32_t buffer_count;      // Provided buffers (power of two)
+    uint32_t buffer_size;       // Bytes of each provided buffer
+    uint16_t buffer_tail;       // Provided buffer ring tail
+} uring;
+
+/**
+ * @brief Check whether the io_uring backend is built in, selected with
+ *        IPC_IO=uring and allowed by the running kernel
+ *
+ * @return int 1 if it can be used
+ */
+int uring_enabled(void);
+
+/**
+ * @brief Set up an io_uring instance
+ *
+ * @param u Instance
+ * @param entries Submission entries (power of two)
+ * @return int 0 if success, -1 if error
+ */
+int uring_init(uring *u, uint32_t entries);
+
+/**
+ * @brief Tear down an io_uring instance, cancelling whatever is pending
+ *
+ * @param u Instance
+ */
+void uring_exit(uring *u);
+
+/**
+ * @brief Register a ring of provided buffers the kernel fills on buffer
+ *        select receives
+ *
+ * @param u Instance
+ * @param group Buffer group id
+ * @param count Buffers (power of two)
+ * @param size Bytes of each buffer
+ * @return int 0 if success, -1 if error
+ */
+int uring_buffers_init(uring *u, uint16_t group, uint32_t count, uint32_t size);
+
+/**
+ * @brief Get a provided buffer
+ *
+ * @param u Instance
+ * @param id Buffer id reported by the completion
+ * @return char* Buffer
+ */
+char* uring_buffer(const uring *u, uint16_t id);
+
+/**
+ * @brief Give a provided buffer back to the kernel
+ *
+ * @param u Instance
+ * @param id Buffer id
+ */
+void uring_buffer_recycle(uring *u, uint16_t id);
+
+/**
+ * @brief Queue a sendmsg. The message, its buffers and its data must stay
+ *        valid until the completion is reaped
+ *
+ * @param u Instance
+ * @param sockect_fd Socket file descriptor
+ * @param msg Message to send
+ * @param flags sendmsg flags
+ * @param link 1 to start the next queued entry only after this one
+ * @param user_data Value reported by the completion
+ * @return int 0 if queued, -1 if the submission ring is full
+ */
+int uring_prep_sendmsg(uring *u, int sockect_fd, const struct msghdr *msg, int flags, int link, uint64_t user_data);
+
+/**
+ * @brief Queue a multishot receive into the provided buffers of a group,
+ *        one completion per receive until it is cancelled or runs out of
+ *        buffers (completion without IORING_CQE_F_MORE)
+ *
+ * @param u Instance
+ * @param sockect_fd Socket file descriptor
+ * @param group Buffer group id
+ * @param user_data Value reported by the completions
+ * @return int 0 if queued, -1 if the submission ring is full
+ */
+int uring_prep_recv_multishot(uring *u, int sockect_fd, uint16_t group, uint64_t user_data);
+
+/**
+ * @brief Queue a multishot accept, one completion (the new socket, close
+ *        on exec) per connection accepted
+ *
+ * @param u Instance
+ * @param sockect_fd Listening socket file descriptor
+ * @param user_data Value reported by the completions
+ * @return int 0 if queued, -1 if the submission ring is full
+ */
+int uring_prep_accept_multishot(uring *u, int sockect_fd, uint64_t user_data);
+
+/**
+ * @brief Submit the queued entries with one system call and wait for
+ *        completions. A signal may end the wait early, callers check
+ *        their completions with uring_next. Completions that overflowed
+ *        the completion ring are moved back into it
+ *
+ * @param u Instance
+ * @param wait_nr Completions to wait for (0 to return right away)
+ * @return int 0 if success, -errno if error
+ */
+int uring_submit(uring *u, uint32_t wait_nr);
+
+/**
+ * @brief Take the next completion, without system calls
+ *
+ * @param u Instance
+ * @param user_data Value of the entry completed
+ * @param res Result of the entry
+ * @param flags Completion flags (URING_CQE_*, buffer id in the upper 16 bits)
+ * @return int 1 if a completion was taken, 0 if there is none
+ */
+int uring_next(uring *u, uint64_t *user_data, int32_t *res, uint32_t *flags);
+
+/**
+ * @brief Check whether completions are waiting to be taken
+ *
+ * @param u Instance
+ * @return int 1 if there are completions
+ */
+int uring_ready(const uring *u);
+
+#endif // __URING_H__
@@ -0,0 +1,206 @@
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_HAVE_PCLMUL 1
+#endif
+
+// Reflected CRC32 polynomial (IEEE 802.3)
+#define CHECKSUM_POLYNOMIAL 0xedb88320
+
+// Minimum length worth the PCLMULQDQ setup cost
+#define CHECKSUM_PCLMUL_MIN_LENGTH 64
+
+// Slice-by-8 lookup tables
+static uint32_t slice8_table[8][256];
+
+// PCLMULQDQ kernel supported by the running CPU
+static int pclmul_supported = 0;
+
+// One time initialization control
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Build slice-by-8 tables and detect the PCLMULQDQ kernel
+ *
+ */
+static void checksum_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (CHECKSUM_POLYNOMIAL & -(crc & 1));
+
+        slice8_table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; i++)
+        for (int k = 1; k < 8; k++)
+            slice8_table[k][i] = (slice8_table[k - 1][i] >> 8) ^ slice8_table[0][slice8_table[k - 1][i] & 0xff];
+
+#ifdef CHECKSUM_HAVE_PCLMUL
+    __builtin_cpu_init();
+
+    pclmul_supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+/**
+ * @brief Slice-by-8 CRC32 kernel
+ *
+ * @param crc CRC state
+ * @param bytes Data
+ * @param length Data length
+ * @return uint32_t Updated CRC state
+ */
+static uint32_t checksum_slice8(uint32_t crc, const uint8_t *bytes, size_t length)
+{
+    while (length >= 8)
+    {
+        uint32_t one = crc ^ ((uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24);
+        uint32_t two = (uint32_t) bytes[4] | (uint32_t) bytes[5] << 8 | (uint32_t) bytes[6] << 16 | (uint32_t) bytes[7] << 24;
+
+        crc = slice8_table[7][one & 0xff] ^ slice8_table[6][(one >> 8) & 0xff] ^
+              slice8_table[5][(one >> 16) & 0xff] ^ slice8_table[4][one >> 24] ^
+              slice8_table[3][two & 0xff] ^ slice8_table[2][(two >> 8) & 0xff] ^
+              slice8_table[1][(two >> 16) & 0xff] ^ slice8_table[0][two >> 24];
+
+        bytes += 8;
+        length -= 8;
+    }
+
+    while (length--)
+        crc = (crc >> 8) ^ slice8_table[0][(crc ^ *bytes++) & 0xff];
+
+    return crc;
+}
+
+#ifdef CHECKSUM_HAVE_PCLMUL
+/**
+ * @brief PCLMULQDQ folding CRC32 kernel (Intel "Fast CRC Computation
+ *        Using PCLMULQDQ"), processes a multiple of 16 bytes, at least 64
+ *
+ * @param crc CRC state
+ * @param bytes Data
+ * @param length Data length
+ * @return uint32_t Updated CRC state
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t checksum_pclmul_blocks(uint32_t crc, const uint8_t *bytes, size_t length)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*) (bytes + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*) (bytes + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*) (bytes + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*) (bytes + 0x30));
+    __m128i t1, t2, t3, t4;
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+
+    bytes += 64;
+    length -= 64;
+
+    while (length >= 64)
+    {
+        t1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        t2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        t3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        t4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), _mm_loadu_si128((const __m128i*) (bytes + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, t2), _mm_loadu_si128((const __m128i*) (bytes + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, t3), _mm_loadu_si128((const __m128i*) (bytes + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, t4), _mm_loadu_si128((const __m128i*) (bytes + 0x30)));
+
+        bytes += 64;
+        length -= 64;
+    }
+
+    // Fold the four accumulators into one
+    t1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), t1), x2);
+
+    t1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), t1), x3);
+
+    t1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), t1), x4);
+
+    // Fold the remaining 16 byte blocks
+    while (length >= 16)
+    {
+        t1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), _mm_loadu_si128((const __m128i*) bytes));
+
+        bytes += 16;
+        length -= 16;
+    }
+
+    // Fold 128 to 64 bits
+    t1 = _mm_clmulepi64_si128(k3k4, x1, 0x01);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t1);
+
+    // Fold 64 to 32 bits
+    t1 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00);
+    x1 = _mm_xor_si128(x1, t1);
+
+    // Barrett reduction
+    t1 = x1;
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, t1);
+
+    return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+
+/**
+ * @brief PCLMULQDQ CRC32 kernel for any length
+ *
+ * @param crc CRC state
+ * @param bytes Data
+ * @param length Data length
+ * @return uint32_t Updated CRC state
+ */
+static uint32_t checksum_pclmul(uint32_t crc, const uint8_t *bytes, size_t length)
+{
+    if (length >= CHECKSUM_PCLMUL_MIN_LENGTH)
+    {
+        size_t blocks = length & ~(size_t) 15;
+
+        crc = checksum_pclmul_blocks(crc, bytes, blocks);
+
+        bytes += blocks;
+        length -= blocks;
+    }
+
+    return checksum_slice8(crc, bytes, length);
+}
+#endif
+
+uint32_t checksum_update(uint32_t crc, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t*) data;
+
+    pthread_once(&checksum_once, checksum_init);
+
+#ifdef CHECKSUM_HAVE_PCLMUL
+    if (pclmul_supported)
+        return checksum_pclmul(crc, bytes, length);
+#endif
+
+    return checksum_slice8(crc, bytes, length);
+}
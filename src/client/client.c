@@ -28,17 +28,17 @@ void signal_handler_init(void)
 
 fp_input_result get_input(char* buffer, size_t buffer_size, FILE* fp)
 {
-    fd_set read_fds;
-    
-    FD_ZERO(&read_fds);
-    FD_SET(STDIN_FILENO, &read_fds);
-    FD_SET(client.unix_socket_fd, &read_fds);
+    struct pollfd read_fds[2] = 
+    {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = client.unix_socket_fd, .events = POLLIN }
+    };
 
     while (1)
     {
-        if(select(client.unix_socket_fd + 1, &read_fds, NULL, NULL, NULL) > 0)
+        if(poll(read_fds, 2, -1) > 0)
         {
-            if (FD_ISSET(client.unix_socket_fd, &read_fds))
+            if (read_fds[1].revents)
                 end();
             else
             {
@@ -65,7 +65,6 @@ fp_input_result get_input(char* buffer, size_t buffer_size, FILE* fp)
 
 void journalctl(void)
 {
-    char* response = NULL;
     char buffer[STDIN_MAX_SIZE];
 
     fp_input_result read_input = INP_NULL;
@@ -86,6 +85,12 @@ void journalctl(void)
             
         if(read_input == INP_EMPTY_LINE)
             strcpy(buffer, " ");
+
+        if (channel_count(client.unix_socket_fd))
+        {
+            journalctl_channels(buffer);
+            continue;
+        }
         
         error_code result = send_data(client.unix_socket_fd, buffer, strlen(buffer) + 1, NULL);
 
@@ -95,43 +100,207 @@ void journalctl(void)
         {
             size_t bytes_receive;
 
-            result = receive_data(client.unix_socket_fd, &response, &bytes_receive, NULL);
-
-            if (result == SUCCESS)
+            if (client.type == CLIENT_TYPE_B)
             {
-                if (client.type == CLIENT_TYPE_B)
-                {
-                    char filename[256];
-                    FILE *fp;
+                char filename[256];
+                download *file = response_file(filename, -1);
 
-                    time_t now;
-                    time(&now);
-                    struct tm *local_time = localtime(&now);
+                result = receive_stream(client.unix_socket_fd, save_response, file, &bytes_receive, NULL);
 
-                    strftime(filename, 256, "data/client_b_result_%Y-%m-%d_%H-%M-%S.txt.gz", local_time);
+                int saved = file && download_close(file, result == SUCCESS) == 0;
 
-                    fp = fopen(filename, "wb");
+                if (result == SUCCESS && saved)
+                    printf(KCYN"\nRecibe and save [%ld B] compress file from server\n\n"KDEF, bytes_receive);
+                else if (result == SUCCESS && file)
+                    fprintf(stderr, KRED"\nError writing file %s\n"KDEF, filename);
+                else if (result == SUCCESS)
+                    fprintf(stderr, KRED"\nError creating file %s\n"KDEF, filename);
+            }
+            else
+            {
+                printf(KYEL"\n");
 
-                    fwrite(response, sizeof(char), bytes_receive, fp);
+                result = receive_stream(client.unix_socket_fd, print_response, NULL, &bytes_receive, NULL);
 
-                    fclose(fp);
+                printf("\n"KDEF);
 
-                    printf(KCYN"\nRecibe and save [%ld B] compress file from server\n\n"KDEF, bytes_receive);
-                }
-                else
-                {
-                    printf(KYEL"\n%s\n"KDEF, response);
+                if (result == SUCCESS)
                     printf(KCYN"\nRecibe [%ld B] from server\n\n"KDEF, bytes_receive);
-                }
             }
-            else
+
+            if (result != SUCCESS)
+                fprintf(stderr, KRED"\nError receiving data from server\n"KDEF);
+        }
+    }
+}
+
+void journalctl_channels(char* buffer)
+{
+    channel_response responses[CONNECTION_MAX_CHANNELS];
+    uint32_t channels = channel_count(client.unix_socket_fd);
+    char* next = buffer;
+
+    while (next)
+    {
+        uint32_t sent = 0;
+        uint32_t pending;
+        uint32_t current;
+
+        memset(responses, 0, sizeof(responses));
+
+        // One query per channel, queries beyond the channels go in the next round
+        while (next && sent < channels)
+        {
+            char* query = next;
+
+            if ((next = strchr(next, ASCII_SEMICOLON)) != NULL)
+                *next++ = ASCII_END_OF_STRING;
+
+            if ((query = trim_white_space(query)) == NULL)
+                query = " ";
+
+            responses[sent].query = query;
+
+            if (client.type == CLIENT_TYPE_B)
+            {
+                char filename[256];
+
+                if ((responses[sent].file = response_file(filename, (int) sent)) == NULL)
+                    fprintf(stderr, KRED"\nError creating file %s\n"KDEF, filename);
+            }
+
+            if (channel_send(client.unix_socket_fd, sent, query, strlen(query) + 1, NULL) != SUCCESS)
+            {
+                fprintf(stderr, KRED"\nError sending data to server\n"KDEF);
+                end();
+            }
+
+            sent++;
+        }
+
+        pending = sent;
+        current = 0;
+
+        if (client.type != CLIENT_TYPE_B)
+            printf(KYEL"\n");
+
+        while (pending)
+        {
+            uint32_t channel;
+            char* data;
+            size_t size;
+            int last;
+
+            if (channel_receive(client.unix_socket_fd, &channel, &data, &size, &last, NULL) != SUCCESS || channel >= sent || responses[channel].done)
+            {
                 fprintf(stderr, KRED"\nError receiving data from server\n"KDEF);
+                end();
+            }
+
+            channel_response* response = &responses[channel];
+
+            if (client.type == CLIENT_TYPE_B)
+            {
+                // A failed write is reported once the response is complete
+                if (response->file)
+                    download_write(response->file, data, size);
+            }
+            else if (channel == current)
+                print_response(NULL, data, size);
+            else
+            {
+                // Only responses waiting for their turn to be printed are kept
+                char* grown = realloc(response->response, response->size + size + 1);
+
+                if (!grown)
+                    end();
+
+                memcpy(grown + response->size, data, size + 1);
+
+                response->response = grown;
+            }
+
+            response->size += size;
+
+            free(data);
+
+            if (!last)
+                continue;
+
+            response->done = 1;
+            pending--;
+
+            if (client.type == CLIENT_TYPE_B)
+            {
+                if (response->file && download_close(response->file, 1) == 0)
+                    printf(KCYN"\nRecibe and save [%ld B] compress file from server (journalctl %s)\n"KDEF, response->size, response->query);
+                else if (response->file)
+                    fprintf(stderr, KRED"\nError writing response of query %u\n"KDEF, channel);
+
+                continue;
+            }
+
+            // Close the printed response and move on, flushing the ones completed meanwhile
+            while (current < sent && responses[current].done)
+            {
+                printf("\n"KDEF);
+                printf(KCYN"\nRecibe [%ld B] from server (journalctl %s)\n"KDEF, responses[current].size, responses[current].query);
+
+                if (++current == sent)
+                    break;
+
+                printf(KYEL"\n");
+
+                if (responses[current].response)
+                    print_response(NULL, responses[current].response, responses[current].size);
 
-            free(response);
+                free(responses[current].response);
+                responses[current].response = NULL;
+            }
+
+            fflush(stdout);
         }
+
+        printf("\n");
     }
 }
 
+download* response_file(char* filename, int channel)
+{
+    time_t now;
+    time(&now);
+    struct tm *local_time = localtime(&now);
+
+    size_t length = strftime(filename, 256, "data/client_b_result_%Y-%m-%d_%H-%M-%S", local_time);
+
+    if (channel < 0)
+        snprintf(filename + length, 256 - length, ".txt.gz");
+    else
+        snprintf(filename + length, 256 - length, "_%d.txt.gz", channel);
+
+    return download_open(filename);
+}
+
+int print_response(void* context, const char* data, size_t size)
+{
+    UNUSED(context);
+
+    fwrite(data, sizeof(char), strnlen(data, size), stdout);
+
+    return 0;
+}
+
+int save_response(void* context, const char* data, size_t size)
+{
+    download *file = (download*) context;
+
+    // Without file the response is still received to keep the connection usable
+    if (!file)
+        return 0;
+
+    return download_write(file, data, size);
+}
+
 void system_info(void)
 {
     size_t bytes_receive;
@@ -260,6 +429,7 @@ void init(client_type clie_type, sockect_type sock_type, const char* arg)
     switch (sock_type)
     {
     case SOCKECT_TYPE_UNIX:
+    case SOCKECT_TYPE_SHM:
         result = connect_unix_sockect(arg);
         break;
 
@@ -285,11 +455,23 @@ void init(client_type clie_type, sockect_type sock_type, const char* arg)
 
     client.type = clie_type;
     
-    char aux[2];
+    connection_options options;
+    char hello[CONNECTION_OPTIONS_SIZE + 8];
+    char* reply = NULL;
+
+    connection_options_default(client.unix_socket_fd, &options);
+
+    // Shared memory is asked for with its own socket type
+    options.transport = sock_type == SOCKECT_TYPE_SHM ? TRANSPORT_RING : TRANSPORT_SOCKET;
 
-    sprintf(aux, "%d", clie_type);
+    int length = sprintf(hello, "%d ", clie_type);
 
-    result = send_data(client.unix_socket_fd, aux, strlen(aux) + 1, NULL);
+    connection_options_format(&options, hello + length, sizeof(hello) - (size_t) length);
+
+    result = send_data(client.unix_socket_fd, hello, strlen(hello) + 1, NULL);
+
+    if (result == SUCCESS)
+        result = receive_data(client.unix_socket_fd, &reply, NULL, NULL);
 
     if (result != SUCCESS) 
     {
@@ -297,6 +479,21 @@ void init(client_type clie_type, sockect_type sock_type, const char* arg)
         end();
     }
 
+    connection_options_legacy(&options);
+    connection_options_parse(reply, &options);
+    connection_configure(client.unix_socket_fd, &options);
+
+    free(reply);
+
+    if (options.transport == TRANSPORT_RING && (result = connection_ring_attach(client.unix_socket_fd)) != SUCCESS)
+    {
+        fprintf(stderr, KRED"\nShared memory setup failed with error code %d\n"KDEF, result);
+        end();
+    }
+
+    if (sock_type == SOCKECT_TYPE_SHM && options.transport != TRANSPORT_RING)
+        fprintf(stderr, KRED"\nServer does not share memory, using the UNIX socket\n"KDEF);
+
     signal_handler_init();
 }
 
@@ -304,6 +501,7 @@ void end(void)
 {
     printf(KRED"\n\nClient end !\n"KDEF);
 
+    connection_release(client.unix_socket_fd);
     close(client.unix_socket_fd);
     free(client.unix_socket_path);
 
@@ -328,13 +526,13 @@ int main(int argc, char* argv[])
 
     int sock_type = atoi(argv[2]);
 
-	if((*argv[2] != '0' && sock_type == 0) || sock_type < 0 || sock_type > 2)
+	if((*argv[2] != '0' && sock_type == 0) || sock_type < 0 || sock_type > 3)
 	{
 		fprintf(stderr, KRED"Bad argument sockect type!"KDEF);
 		exit(EXIT_FAILURE);
 	}
 
-    if(sock_type == 0 && argc > 3)
+    if((sock_type == SOCKECT_TYPE_UNIX || sock_type == SOCKECT_TYPE_SHM) && argc > 3)
     {
         fprintf(stderr, KRED"\nUnix sockect not required extra argument!\n"KDEF);
         exit(EXIT_FAILURE);
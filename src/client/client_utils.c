@@ -1,3 +1,6 @@
+// fallocate
+#define _GNU_SOURCE
+
 #include "client_utils.h"
 
 char* trim_white_space(char* str)
@@ -16,4 +19,119 @@ char* trim_white_space(char* str)
     endOfStr[1] = ASCII_END_OF_STRING;
 
     return str;
-}
\ No newline at end of file
+}
+
+download* download_open(const char *path)
+{
+    download* file = calloc(1, sizeof(download));
+
+    if (!file)
+        return NULL;
+
+    snprintf(file->path, sizeof(file->path), "%s", path);
+    snprintf(file->temp_path, sizeof(file->temp_path), "%s.part", path);
+
+    if (posix_memalign((void**) &file->buffer, DOWNLOAD_ALIGNMENT, DOWNLOAD_BUFFER_SIZE) != 0)
+    {
+        free(file);
+        return NULL;
+    }
+
+    if ((file->fd = open(file->temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    {
+        free(file->buffer);
+        free(file);
+        return NULL;
+    }
+
+    // Reserving fails on file systems without fallocate, the file then grows with each write
+    if (fallocate(file->fd, FALLOC_FL_KEEP_SIZE, 0, DOWNLOAD_RESERVE_STEP) == 0)
+        file->reserved = DOWNLOAD_RESERVE_STEP;
+
+    return file;
+}
+
+/**
+ * @brief Write the buffered bytes of a download
+ * 
+ * @param file Download
+ * @return int 0 if success, -1 if error
+ */
+static int download_flush(download *file)
+{
+    size_t written = 0;
+
+    if (file->reserved && file->size + file->buffered > file->reserved)
+    {
+        if (fallocate(file->fd, FALLOC_FL_KEEP_SIZE, (off_t) file->reserved, DOWNLOAD_RESERVE_STEP) == 0)
+            file->reserved += DOWNLOAD_RESERVE_STEP;
+        else
+            file->reserved = 0;
+    }
+
+    while (written < file->buffered)
+    {
+        ssize_t result = write(file->fd, file->buffer + written, file->buffered - written);
+
+        if (result < 0 && errno == EINTR)
+            continue;
+
+        if (result <= 0)
+        {
+            file->failed = 1;
+            return -1;
+        }
+
+        written += (size_t) result;
+    }
+
+    file->size += file->buffered;
+    file->buffered = 0;
+
+    return 0;
+}
+
+int download_write(download *file, const char *data, size_t size)
+{
+    while (size > 0 && !file->failed)
+    {
+        size_t count = DOWNLOAD_BUFFER_SIZE - file->buffered;
+
+        if (count > size)
+            count = size;
+
+        memcpy(file->buffer + file->buffered, data, count);
+
+        file->buffered += count;
+        data += count;
+        size -= count;
+
+        if (file->buffered == DOWNLOAD_BUFFER_SIZE)
+            download_flush(file);
+    }
+
+    return file->failed ? -1 : 0;
+}
+
+int download_close(download *file, int complete)
+{
+    int saved = complete && !file->failed && download_flush(file) == 0;
+
+    // Truncating to the current size gives back the space reserved past the end
+    if (saved && file->reserved > file->size && ftruncate(file->fd, (off_t) file->size) != 0)
+        saved = 0;
+
+    if (close(file->fd) != 0)
+        saved = 0;
+
+    if (saved && rename(file->temp_path, file->path) != 0)
+        saved = 0;
+
+    if (!saved)
+        unlink(file->temp_path);
+
+    free(file->buffer);
+    free(file);
+
+    return saved ? 0 : -1;
+}
@@ -1,7 +1,96 @@
+// memfd_create
+#define _GNU_SOURCE
+
 #include "communication_api.h"
+#include "checksum.h"
+#include "uring.h"
 
 // Data fragment size (without header) 
-#define DATA_FRAGMENT_SIZE FRAGMENT_SIZE - HEADER_SIZE
+#define DATA_FRAGMENT_SIZE (FRAGMENT_SIZE - HEADER_SIZE)
+
+// Binary frame magic number
+#define BINARY_FRAME_MAGIC 0xF7A5
+
+// Binary frame version
+#define BINARY_FRAME_VERSION 1
+
+// Binary frame header size
+#define BINARY_HEADER_SIZE 24
+
+// Binary frame flag: last fragment
+#define FRAME_FLAG_LAST 0x01
+
+// Binary frame flag: acknowledgement, sequence is the next expected fragment
+// and data a list of fragments to resend
+#define FRAME_FLAG_ACK 0x02
+
+// Binary frame flag: request channel fragment, sequence is the channel and
+// the last flag ends the message of that channel
+#define FRAME_FLAG_CHANNEL 0x04
+
+// Binary frame flag: bulk transfer, the data (total size bytes) is in the
+// sealed memory file passed with the header and the checksum covers it all
+#define FRAME_FLAG_BULK 0x08
+
+// Total size of the frames of a stream (not known in advance)
+#define BINARY_STREAM_SIZE UINT64_MAX
+
+// Max fragments to resend listed in one acknowledgement
+#define ACK_MAX_NACKS (DATA_FRAGMENT_SIZE / 4)
+
+// Extra bytes the JSON encoder needs past the end of its output
+#define JSON_ENCODE_SLACK 8
+
+// Data bytes per JSON fragment with base64 payload (fits DATA_FRAGMENT_SIZE encoded)
+#define JSON_BASE64_DATA_SIZE (DATA_FRAGMENT_SIZE / 4 * 3)
+
+// Base64 decoding table value of characters out of the alphabet
+#define BASE64_INVALID 0xFF
+
+// Sockets per connection table chunk
+#define CONNECTION_CHUNK_SIZE 1024
+
+// Connection table chunks
+#define CONNECTION_CHUNKS 1024
+
+// Read-ahead buffer size of configured connections
+#define CONNECTION_INPUT_SIZE (64 * 1024)
+
+// Size of pooled frame buffers
+#define POOL_FRAME_SIZE (FRAGMENT_SIZE + JSON_ENCODE_SLACK)
+
+// Offset of the ring data in the shared memory of a connection (control blocks before)
+#define RING_DATA_OFFSET 4096
+
+// Size of the shared memory of a connection (two rings)
+#define RING_MEMORY_SIZE (RING_DATA_OFFSET + 2 * (size_t) CONNECTION_RING_SIZE)
+
+// Descriptors passed to set up the rings (memory and two events per ring)
+#define RING_FDS 5
+
+// Checks of a ring before sleeping on its event, the other end is often about to answer
+#define RING_SPIN 4096
+
+// Sends batched per io_uring submission (entries of the send ring)
+#define URING_SENDS 64
+
+// Provided receive buffers of a connection on the io_uring backend (power of two)
+#define URING_BUFFERS 16
+
+// Bytes of each provided receive buffer
+#define URING_BUFFER_SIZE CONNECTION_INPUT_SIZE
+
+// Group of the provided receive buffers
+#define URING_BUFFER_GROUP 0
+
+// Memory files of bulk frames a connection holds before reading their headers
+#define BULK_FDS 8
+
+// Seals a bulk memory file needs before its receiver maps it
+#define BULK_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+// Bytes checksummed and then written to a bulk memory file at once, still cached for the write
+#define BULK_CHUNK (256 * 1024)
 
 /**
  * @brief Data fragment
@@ -13,379 +102,4072 @@ typedef struct fragments
     size_t total_size;              // Total size of all fragments
     size_t content_size;            // Total size of this fragment
     uint8_t last;                   // Last fragment flag
-    char data[DATA_FRAGMENT_SIZE];  // Data of fragment
+    uint32_t sequence;              // Sequence number of fragment
+    char* data;                     // Data of fragment (view into the message buffer)
     struct fragments* next;         // Next fragment
 } fragments;
 
 /**
- * @brief Generate checksum
+ * @brief Binary frame header
  *
- * @param data Data to generate checksum
- * @param length Data length
- * @return int Checksum
  */
-int generate_checksum(void *data, size_t length) 
+typedef struct
 {
-    const uint8_t* bytes = (const uint8_t*) data;
-
-    uint32_t crc = 0xffffffff;
-
-    for (size_t i = 0; i < length; ++i) 
-    {
-        crc ^= bytes[i];
-
-        for (int j = 0; j < 8; ++j) 
-        {
-            uint32_t mask = -(crc & 1);
+    uint8_t flags;          // Frame flags
+    uint32_t sequence;      // Fragment sequence (next expected fragment on acknowledgements)
+    int checksum;           // Checksum of data
+    uint32_t content_size;  // Size of data following the header
+    uint64_t total_size;    // Total size of all fragments
+} frame_header;
 
-            crc = (crc >> 1) ^ (0xedb88320 & mask);
-        }
-    }
+/**
+ * @brief Control block of a shared memory ring. Counters only grow, the
+ *        producer and consumer sides sit on their own cache lines
+ *
+ */
+typedef struct
+{
+    uint64_t tail;              // Bytes written (producer)
+    uint32_t writer_waiting;    // Producer waits for space
+    uint8_t tail_padding[52];
+    uint64_t head;              // Bytes read (consumer)
+    uint32_t reader_waiting;    // Consumer waits for data
+    uint8_t head_padding[52];
+} ring_control;
 
-    return (int)~crc;
-}
+/**
+ * @brief One direction of a shared memory transport (single producer,
+ *        single consumer)
+ *
+ */
+typedef struct
+{
+    ring_control* control;      // Control block in shared memory
+    char* data;                 // Ring data in shared memory (CONNECTION_RING_SIZE bytes)
+    int data_fd;                // Event written when data is written and the consumer waits
+    int space_fd;               // Event written when space is freed and the producer waits
+} ring;
 
 /**
- * @brief Validate checksum
+ * @brief Send queued on the io_uring backend, kept until it completes
  *
- * @param data Data to validate checksum
- * @param length Data length
- * @param checksum Checksum
- * @return int Checksum
  */
-int validate_checksum(void *data, size_t length, int checksum) 
+typedef struct
 {
-    return generate_checksum(data, length) == checksum;
-}
+    struct msghdr msg;                      // Message
+    struct iovec iov[2];                    // Frame header and data
+    uint8_t header[BINARY_HEADER_SIZE];     // Copy of the frame header
+} uring_send;
 
 /**
- * @brief Defragment data
+ * @brief io_uring backend state of a connection
  *
- * @param first First fragment
- * @return char* Defragmented data
  */
-char* defragment(fragments* first)
+typedef struct
 {
-    fragments* current = first;
-    size_t data_size = 0;
+    uring tx;                           // Batched sends of windowed transfers
+    uring rx;                           // Multishot receive into provided buffers
+    uring_send sends[URING_SENDS];      // Sends queued or in flight
+    uint32_t pending;                   // Sends queued or in flight
+    int armed;                          // Multishot receive armed
+    int32_t buffer;                     // Provided buffer being read, -1 if none
+    size_t buffer_start;                // First byte of the buffer not consumed yet
+    size_t buffer_end;                  // End of bytes received in the buffer
+    error_code closed;                  // Error reported by the receive, SUCCESS while open
+} connection_uring;
 
-    while(current)
-    {
-        data_size += current->content_size;
-        current = current->next;
-    }
+/**
+ * @brief Connection state of a socket
+ *
+ */
+typedef struct
+{
+    connection_options options;     // Negotiated options
+    char* input;                    // Bytes read ahead from the socket (CONNECTION_INPUT_SIZE), NULL until needed
+    size_t input_start;             // First byte not consumed yet
+    size_t input_end;               // End of bytes read ahead
+    pthread_mutex_t write_mutex;    // Serializes frames of request channels and the use of the deflater
+    int compressed;                 // Compression streams initialized
+    z_stream deflater;              // Compression of data sent
+    z_stream inflater;              // Decompression of data received
+    char* channel_output;           // Compressed channel fragment (fragment_size bytes)
+    void* ring_memory;              // Shared memory of the rings, NULL on the socket transport
+    ring tx;                        // Ring of bytes sent
+    ring rx;                        // Ring of bytes received
+    connection_uring* io;           // io_uring backend state, NULL on blocking sockets
+    int bulk_fds[BULK_FDS];         // Memory files received ahead of their bulk frames, oldest first
+    uint32_t bulk_fd_count;         // Number of memory files waiting
+} connection;
 
-    char* data = calloc(data_size, sizeof(char));
+// Connection states indexed by socket file descriptor
+static connection** connection_table[CONNECTION_CHUNKS];
 
-    current = first;
+// Mutex for connection table updates
+static pthread_mutex_t connection_table_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-    size_t offset = 0;
+// Event descriptor written by communication_wakeup
+static int wakeup_fd = -1;
 
-    while(current)
-    {
-        memcpy(data + offset, current->data, current->content_size);
+// Wakeup descriptor initialization control
+static pthread_once_t wakeup_once = PTHREAD_ONCE_INIT;
 
-        offset += current->content_size;
-        current = current->next;
-    }
+/**
+ * @brief Data compressed on its way to the socket, either a whole message
+ *        or the output of a producer
+ *
+ */
+typedef struct
+{
+    z_stream* deflater;         // Compression stream of the connection
+    const char* data;           // Message to compress, NULL when streaming
+    size_t data_size;           // Message size
+    stream_producer producer;   // Producer of data to compress
+    void* context;              // Producer context
+    char* input;                // Producer output (CONNECTION_COMPRESSION_CHUNK)
+    size_t bytes;               // Uncompressed bytes taken
+    int input_done;             // All data passed to the compression stream
+    int flushed;                // Compression stream flushed at the end of the data
+} compress_source;
 
-    return data;
-}
+/**
+ * @brief Data decompressed on its way to a consumer
+ *
+ */
+typedef struct
+{
+    z_stream* inflater;         // Decompression stream of the connection
+    stream_consumer consumer;   // Consumer of decompressed data
+    void* context;              // Consumer context
+    char* output;               // Decompressed bytes (CONNECTION_COMPRESSION_CHUNK)
+    size_t bytes;               // Decompressed bytes passed to the consumer
+} decompress_sink;
 
 /**
- * @brief Get relative size of fragment payload
+ * @brief Message being received through a stream
  *
- * @param data Data
- * @param data_size Data size
- * @param fragment_size Fragment size
- * @return size_t Relative size
  */
-size_t get_relative_size(char* data, size_t data_size, size_t fragment_size)
+typedef struct
 {
-    size_t count = 0;
-    size_t acumulate = 0;
+    char* data;         // Bytes received (NUL terminated)
+    size_t size;        // Number of bytes received
+    size_t capacity;    // Buffer capacity
+} stream_buffer;
 
-    do
-    {
-        char c = data[count];
-
-        if(c >= 100)
-            acumulate += 4;
-        else if(c >= 10)
-            acumulate += 3;
-        else if(c >= 0)
-            acumulate += 2;
-        else if(c <= -100)
-            acumulate += 5;
-        else if(c <= -10)
-            acumulate += 4;
-        else
-            acumulate += 3;
-        
-        count++;
-    } while (acumulate < fragment_size && count < data_size);
+/**
+ * @brief Pooled block classes
+ *
+ */
+typedef enum
+{
+    POOL_FRAGMENT,  // fragments node
+    POOL_FRAME,     // Frame buffer (POOL_FRAME_SIZE bytes)
+    POOL_WINDOW,    // Receive window bitmap (CONNECTION_MAX_WINDOW bytes)
+    POOL_CLASSES    // Number of classes
+} pool_class;
 
-    return count;
-}
+/**
+ * @brief Free pooled block
+ *
+ */
+typedef struct pool_block
+{
+    struct pool_block* next;    // Next free block
+} pool_block;
 
 /**
- * @brief Fragment data
+ * @brief Per-thread pool of free blocks
  *
- * @param data Data to fragment
- * @param data_size Data size
- * @param fragment_size Fragment size
- * @return fragments* First fragment
  */
-fragments* fragment(char* data, size_t data_size, size_t fragment_size)
+typedef struct
 {
-    fragments* first = calloc(1, sizeof(fragments));
-    fragments* current = first;
+    pool_block* free[POOL_CLASSES]; // Free blocks of every class
+    size_t cached[POOL_CLASSES];    // Number of free blocks of every class
+} pool;
 
-    current->next = NULL;
-    current->total_size = data_size;
+// Block size of every pool class
+static const size_t pool_block_size[POOL_CLASSES] = { sizeof(fragments), POOL_FRAME_SIZE, CONNECTION_MAX_WINDOW };
 
-    size_t remaining_data_size = data_size;
-    size_t current_data_size = 0;
+// Max free blocks kept by a thread for every pool class
+static const size_t pool_max_cached[POOL_CLASSES] = { 1024, 4, 4 };
 
-    while(remaining_data_size > 0)
-    {
-        current_data_size = remaining_data_size > fragment_size ? get_relative_size(data + data_size - remaining_data_size, fragment_size, fragment_size) : get_relative_size(data + data_size - remaining_data_size, remaining_data_size, fragment_size);
+// Thread pool key
+static pthread_key_t pool_key;
 
-        memcpy(current->data, data + data_size - remaining_data_size, current_data_size);
+// Pool key initialization control
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
 
-        current->content_size = current_data_size;
+// JSON text of every byte value preceded by a comma, e.g. ",-128"
+static char json_byte_text[256][JSON_ENCODE_SLACK];
 
-        current->checksum = generate_checksum(current->data, current->content_size);
+// Length of every entry of json_byte_text
+static uint8_t json_byte_width[256];
 
-        remaining_data_size -= current_data_size;
+// Base64 alphabet
+static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-        if(remaining_data_size > 0)
-        {
-            current->last = 0;
-            current->next = calloc(1, sizeof(fragments));
-            
-            current->next->total_size = current->total_size;
+// Base64 text of every 12 bit value (two characters)
+static char base64_pair[4096][2];
 
-            current = current->next; 
+// Value of every base64 character, BASE64_INVALID out of the alphabet
+static uint8_t base64_value[256];
 
-            current->next = NULL;  
-        }
-    }
+// JSON tables initialization control
+static pthread_once_t json_tables_once = PTHREAD_ONCE_INIT;
 
-    current->last = 1;
+/**
+ * @brief JSON parser cursor
+ *
+ */
+typedef struct
+{
+    const char* ptr;    // Current position
+    const char* end;    // End of input
+} json_cursor;
 
-    return first;
+/**
+ * @brief JSON fragment keys
+ *
+ */
+typedef enum
+{
+    JSON_KEY_CHECKSUM = 1 << 0,     // "checksum"
+    JSON_KEY_TOTAL_SIZE = 1 << 1,   // "total_size"
+    JSON_KEY_CONTENT_SIZE = 1 << 2, // "content_size"
+    JSON_KEY_LAST = 1 << 3,         // "last"
+    JSON_KEY_DATA = 1 << 4,         // "data"
+    JSON_KEY_ALL = (1 << 5) - 1     // All keys
+} json_key;
+
+/**
+ * @brief Get connection state of a socket
+ *
+ * @param sockect_fd Socket file descriptor
+ * @return connection* Connection state, NULL if not configured
+ */
+static connection* connection_get(int sockect_fd)
+{
+    if (sockect_fd < 0 || sockect_fd >= CONNECTION_CHUNK_SIZE * CONNECTION_CHUNKS)
+        return NULL;
+
+    connection** chunk = __atomic_load_n(&connection_table[sockect_fd / CONNECTION_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+
+    if (!chunk)
+        return NULL;
+
+    return __atomic_load_n(&chunk[sockect_fd % CONNECTION_CHUNK_SIZE], __ATOMIC_ACQUIRE);
 }
 
 /**
- * @brief Free fragment list
+ * @brief Get options in use on a socket
  *
- * @param first First fragment
+ * @param sockect_fd Socket file descriptor
+ * @param options Options in use
  */
-void free_package_list(fragments* first) 
+static void connection_get_options(int sockect_fd, connection_options *options)
 {
-    fragments* current = first;
-    fragments* aux;
+    connection* conn = connection_get(sockect_fd);
 
-    while(current)
-    {
-        aux = current;
-        current = current->next;
-        free(aux);
-    }
+    if (conn)
+        *options = conn->options;
+    else
+        connection_options_legacy(options);
+}
+
+void connection_options_legacy(connection_options *options)
+{
+    memset(options, 0, sizeof(connection_options));
+
+    options->format = WIRE_FORMAT_JSON;
+    options->window = 1;
+    options->fragment_size = DATA_FRAGMENT_SIZE;
 }
 
 /**
- * @brief Encode fragment to JSON
+ * @brief Clamp a fragment size to the supported range
  *
- * @param package Fragment
- * @return char* JSON string
+ * @param fragment_size Requested data bytes per fragment
+ * @return uint32_t Supported data bytes per fragment
  */
-char* encode_json(fragments* package)
+static uint32_t fragment_size_clamp(unsigned long fragment_size)
 {
-    size_t json_size = (size_t) snprintf(NULL, 0, "{\"checksum\":%d,\"total_size\":%zu,\"content_size\":%zu,\"last\":%u,\"data\":[", 
-                                package->checksum, package->total_size, package->content_size, package->last);
+    if (fragment_size < CONNECTION_MIN_FRAGMENT_SIZE)
+        return CONNECTION_MIN_FRAGMENT_SIZE;
 
-    size_t data_size = (size_t) snprintf(NULL, 0, "\"%d\"", package->data[0]);
+    if (fragment_size > CONNECTION_MAX_FRAGMENT_SIZE)
+        return CONNECTION_MAX_FRAGMENT_SIZE;
 
-    for (size_t i = 1; i < package->content_size; i++)
-        data_size += (size_t) snprintf(NULL, 0, ",\"%d\"", package->data[i]);
+    return (uint32_t) fragment_size;
+}
+
+/**
+ * @brief Get the default fragment size of the transport of a socket
+ *
+ * @param sockect_fd Connected socket file descriptor
+ * @param window Fragments in flight
+ * @return uint32_t Data bytes per fragment
+ */
+static uint32_t transport_fragment_size(int sockect_fd, uint32_t window)
+{
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    int send_buffer = 0;
+    int segment = 0;
 
-    json_size += data_size + 2;
+    if (sockect_fd < 0 || getsockname(sockect_fd, (struct sockaddr*) &address, &length) != 0)
+        return DATA_FRAGMENT_SIZE;
 
-    char* json_string = calloc(json_size + 1, sizeof(char));
+    if (address.ss_family == AF_UNIX)
+        return CONNECTION_UNIX_FRAGMENT_SIZE;
 
-    size_t offset = (size_t) snprintf(json_string, json_size + 1, "{\"checksum\":%d,\"total_size\":%zu,\"content_size\":%zu,\"last\":%u,\"data\":[%d", 
-                             package->checksum, package->total_size, package->content_size, package->last, package->data[0]);
+    length = sizeof(send_buffer);
 
-    for (size_t i = 1; i < package->content_size; i++)
-        offset += (size_t) snprintf(json_string + offset, json_size + 1 - offset, ",%d", package->data[i]);
+    if (getsockopt(sockect_fd, SOL_SOCKET, SO_SNDBUF, &send_buffer, &length) != 0 || send_buffer <= 0)
+        return DATA_FRAGMENT_SIZE;
 
-    offset += (size_t) snprintf(json_string + offset, json_size + 1 - offset, "]}");
+    length = sizeof(segment);
 
-    return json_string;
+    if (getsockopt(sockect_fd, IPPROTO_TCP, TCP_MAXSEG, &segment, &length) != 0 || segment <= BINARY_HEADER_SIZE)
+        return DATA_FRAGMENT_SIZE;
+
+    // A window of whole segments fills the send buffer, the header rides in the first segment
+    uint32_t segments = (uint32_t) send_buffer / window / (uint32_t) segment;
+
+    return fragment_size_clamp((unsigned long) (segments ? segments : 1) * (unsigned long) segment - BINARY_HEADER_SIZE);
 }
 
 /**
- * @brief Decode JSON to fragment
+ * @brief Get the address family of a socket
  *
- * @param json_string JSON string
- * @return fragments* Fragment
+ * @param sockect_fd Socket file descriptor
+ * @return int Address family, -1 if unknown
  */
-fragments* decode_json (const char* json_string)
+static int socket_family(int sockect_fd)
 {
-    fragments *package = calloc(1, sizeof(fragments));
-    char* ptr;
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
 
-    package->next = NULL;
+    if (sockect_fd < 0 || getsockname(sockect_fd, (struct sockaddr*) &address, &length) != 0)
+        return -1;
 
-    ptr = strstr(json_string, "\"checksum\":");
-    if (ptr != NULL)
-        package->checksum = atoi(ptr + strlen("\"checksum\":"));
-    
-    ptr = strstr(json_string, "\"total_size\":");
-    if (ptr != NULL) 
-        package->total_size = (size_t) atoll(ptr + strlen("\"total_size\":"));
+    return address.ss_family;
+}
 
-    ptr = strstr(json_string, "\"content_size\":");
-    if (ptr != NULL)
-        package->content_size = (size_t) atoll(ptr + strlen("\"content_size\":"));
+void connection_options_default(int sockect_fd, connection_options *options)
+{
+    const char* format = getenv("IPC_FORMAT");
+    const char* window = getenv("IPC_WINDOW");
+    const char* fragment_size = getenv("IPC_FRAGMENT_SIZE");
+    const char* channels = getenv("IPC_CHANNELS");
+    const char* payload = getenv("IPC_PAYLOAD");
+    const char* compression = getenv("IPC_COMPRESSION");
+    const char* transport = getenv("IPC_TRANSPORT");
+    const char* bulk = getenv("IPC_BULK");
 
-    ptr = strstr(json_string, "\"last\":");
-    if (ptr != NULL)
-        package->last = (uint8_t) atoi(ptr + strlen("\"last\":"));
+    connection_options_legacy(options);
 
-    ptr = strstr(json_string, ",\"data\":[");
-    if (ptr != NULL)
-    {
-        ptr += strlen(",\"data\":[");
+    options->format = WIRE_FORMAT_BINARY;
+    options->window = CONNECTION_DEFAULT_WINDOW;
+    options->framing = FRAMING_LENGTH;
+    options->channels = CONNECTION_DEFAULT_CHANNELS;
+    options->payload = JSON_PAYLOAD_BASE64;
+    // Local sockets move data faster than it can be compressed, and only they can share memory
+    options->compression = socket_family(sockect_fd) == AF_INET || socket_family(sockect_fd) == AF_INET6 ? COMPRESSION_DEFLATE : COMPRESSION_NONE;
+    options->transport = socket_family(sockect_fd) == AF_UNIX ? TRANSPORT_RING : TRANSPORT_SOCKET;
 
-        for (size_t i = 0; i < package->content_size; i++) 
-        {
-            sscanf(ptr, "%hhd", (signed char*)&package->data[i]);
+    if (format && strcmp(format, "json") == 0)
+        options->format = WIRE_FORMAT_JSON;
 
-            ptr = strchr(ptr, ',');
+    if (window && atoi(window) > 0)
+        options->window = (uint32_t) atoi(window) < CONNECTION_MAX_WINDOW ? (uint32_t) atoi(window) : CONNECTION_MAX_WINDOW;
 
-            if (ptr == NULL || *(ptr + 1) == ']')
-                break;
+    options->fragment_size = transport_fragment_size(sockect_fd, options->window);
 
-            ptr++;
-        }
-    }
+    if (fragment_size && atol(fragment_size) > 0)
+        options->fragment_size = fragment_size_clamp((unsigned long) atol(fragment_size));
 
-    return package;
-}
+    if (channels && atoi(channels) >= 0)
+        options->channels = (uint32_t) atoi(channels) < CONNECTION_MAX_CHANNELS ? (uint32_t) atoi(channels) : CONNECTION_MAX_CHANNELS;
 
-error_code receive_data(int sockect_fd, char **buffer, size_t* bytes_received, volatile sig_atomic_t *end_flag)
-{
-    fragments* first = NULL, *current = NULL, *prev = NULL;
-    int resend;
+    if (payload && strcmp(payload, "array") == 0)
+        options->payload = JSON_PAYLOAD_ARRAY;
 
-    if(bytes_received)
-        *bytes_received = 0;
+    if (compression)
+        options->compression = strcmp(compression, "deflate") == 0 ? COMPRESSION_DEFLATE : COMPRESSION_NONE;
 
-    while (1)
-    {
-        struct timeval timeout = {0, 100000};
-        fd_set read_fds;
+    if (transport)
+        options->transport = strcmp(transport, "ring") == 0 ? TRANSPORT_RING : TRANSPORT_SOCKET;
+
+    // Descriptors only travel over UNIX sockets, and the multishot receive of io_uring drops them
+    if (bulk && atol(bulk) > 0 && socket_family(sockect_fd) == AF_UNIX && !uring_enabled())
+        options->bulk = (unsigned long) atol(bulk) < UINT32_MAX ? (uint32_t) atol(bulk) : UINT32_MAX;
+}
 
-        FD_ZERO(&read_fds);
-        FD_SET(sockect_fd, &read_fds);
+int connection_options_parse(const char *text, connection_options *options)
+{
+    char key[32];
+    char value[32];
+    int recognized = 0;
+    int consumed;
 
-        if(end_flag && *end_flag)
-            return END_SIGNAL;
+    while (sscanf(text, " %31[^= ]=%31s%n", key, value, &consumed) == 2)
+    {
+        if (strcmp(key, "format") == 0)
+        {
+            if (strcmp(value, "binary") == 0)
+                options->format = WIRE_FORMAT_BINARY;
+            else
+                options->format = WIRE_FORMAT_JSON;
 
-        if (select(sockect_fd + 1, &read_fds, NULL, NULL, &timeout) > 0)
+            recognized++;
+        }
+        else if (strcmp(key, "framing") == 0)
         {
-            if(FD_ISSET(sockect_fd, &read_fds))
-            {
-                char* json_package = calloc(FRAGMENT_SIZE + 1, sizeof(char));
+            options->framing = strcmp(value, "length") == 0 ? FRAMING_LENGTH : FRAMING_PADDED;
 
-                if(recv(sockect_fd, json_package, FRAGMENT_SIZE, 0) == 0)
-                    return ERROR_SOCKET_DISCONNECT;
+            recognized++;
+        }
+        else if (strcmp(key, "window") == 0)
+        {
+            unsigned long window = strtoul(value, NULL, 10);
 
-                current = decode_json(json_package);
+            options->window = window < 1 ? 1 : window > CONNECTION_MAX_WINDOW ? CONNECTION_MAX_WINDOW : (uint32_t) window;
 
-                if(!first)
-                    first = current;
-                else
-                    prev->next = current;
+            recognized++;
+        }
+        else if (strcmp(key, "fragment") == 0)
+        {
+            options->fragment_size = fragment_size_clamp(strtoul(value, NULL, 10));
 
-                free(json_package);
+            recognized++;
+        }
+        else if (strcmp(key, "channels") == 0)
+        {
+            unsigned long channels = strtoul(value, NULL, 10);
 
-                if(!validate_checksum(current->data, current->content_size, current->checksum))
-                {
-                    resend = 1;
-                    send(sockect_fd, &resend, sizeof(int), 0);
+            options->channels = channels > CONNECTION_MAX_CHANNELS ? CONNECTION_MAX_CHANNELS : (uint32_t) channels;
 
-                    if(prev)
-                        prev->next = NULL;
-                    else
-                        first = NULL;
+            recognized++;
+        }
+        else if (strcmp(key, "payload") == 0)
+        {
+            options->payload = strcmp(value, "base64") == 0 ? JSON_PAYLOAD_BASE64 : JSON_PAYLOAD_ARRAY;
 
-                    continue;
-                }
+            recognized++;
+        }
+        else if (strcmp(key, "compression") == 0)
+        {
+            options->compression = strcmp(value, "deflate") == 0 ? COMPRESSION_DEFLATE : COMPRESSION_NONE;
 
-                resend = 0;
-                send(sockect_fd, &resend, sizeof(int), 0);
+            recognized++;
+        }
+        else if (strcmp(key, "transport") == 0)
+        {
+            options->transport = strcmp(value, "ring") == 0 ? TRANSPORT_RING : TRANSPORT_SOCKET;
 
-                if(bytes_received)
-                    *bytes_received += current->content_size;
+            recognized++;
+        }
+        else if (strcmp(key, "bulk") == 0)
+        {
+            unsigned long bulk = strtoul(value, NULL, 10);
 
-                if(current->last)
-                    break;
+            options->bulk = bulk > UINT32_MAX ? UINT32_MAX : (uint32_t) bulk;
 
-                prev = current;
-            }
+            recognized++;
         }
+
+        text += consumed;
     }
 
-    *buffer = defragment(first);
+    return recognized;
+}
 
-    free_package_list(first);
+size_t connection_options_format(const connection_options *options, char *buffer, size_t buffer_size)
+{
+    int length = snprintf(buffer, buffer_size, "format=%s window=%u framing=%s fragment=%u channels=%u payload=%s compression=%s transport=%s bulk=%u", options->format == WIRE_FORMAT_BINARY ? "binary" : "json", 
+                          options->window, options->framing == FRAMING_LENGTH ? "length" : "padded", options->fragment_size, options->channels,
+                          options->payload == JSON_PAYLOAD_BASE64 ? "base64" : "array", options->compression == COMPRESSION_DEFLATE ? "deflate" : "none",
+                          options->transport == TRANSPORT_RING ? "ring" : "socket", options->bulk);
 
-    return SUCCESS;
+    return length < 0 ? 0 : (size_t) length;
 }
 
-error_code send_data(int sockect_fd, char *data, size_t data_size, volatile sig_atomic_t *end_flag) 
+void connection_options_negotiate(const connection_options *offer, const connection_options *local, connection_options *agreed)
 {
-    fragments* first = fragment(data, data_size, DATA_FRAGMENT_SIZE);
-    fragments* current = first;
-    int resend;
-    int retries;
-    size_t sending_bytes = 0;
+    connection_options_legacy(agreed);
 
-    while(current)
-    {
-        char* json_package = encode_json(current);
-        
-        retries = 0;
+    if (offer->framing == FRAMING_LENGTH && local->framing == FRAMING_LENGTH)
+        agreed->framing = FRAMING_LENGTH;
 
-        do
-        {
-            if(end_flag && *end_flag)
-                return END_SIGNAL;
+    if (offer->payload == JSON_PAYLOAD_BASE64 && local->payload == JSON_PAYLOAD_BASE64)
+        agreed->payload = JSON_PAYLOAD_BASE64;
 
-            if (send(sockect_fd, json_package, FRAGMENT_SIZE, 0) < 0) 
-            {
-                if(retries > 3)
-                {
-                    free_package_list(first);
-                    return ERROR_SOCKET_SEND;
-                }
-                else
-                    retries++;
-            }
+    if (offer->compression == COMPRESSION_DEFLATE && local->compression == COMPRESSION_DEFLATE)
+        agreed->compression = COMPRESSION_DEFLATE;
 
-            recv(sockect_fd, &resend, sizeof(int), 0);
-        } while (resend);
-        
-        sending_bytes += current->content_size;
-        
-        current = current->next;
+    if (offer->transport == TRANSPORT_RING && local->transport == TRANSPORT_RING)
+        agreed->transport = TRANSPORT_RING;
+
+    if (offer->format == WIRE_FORMAT_BINARY && local->format == WIRE_FORMAT_BINARY)
+    {
+        agreed->format = WIRE_FORMAT_BINARY;
+        agreed->window = offer->window < local->window ? offer->window : local->window;
+        agreed->fragment_size = offer->fragment_size < local->fragment_size ? offer->fragment_size : local->fragment_size;
+        agreed->channels = offer->channels < local->channels ? offer->channels : local->channels;
+
+        // The rings already share memory, the larger threshold suits both ends
+        if (offer->bulk && local->bulk && agreed->transport == TRANSPORT_SOCKET)
+            agreed->bulk = offer->bulk > local->bulk ? offer->bulk : local->bulk;
+
+        // Bound the memory a window of slots takes on both ends
+        if ((uint64_t) agreed->window * agreed->fragment_size > CONNECTION_MAX_WINDOW_BYTES)
+            agreed->window = CONNECTION_MAX_WINDOW_BYTES / agreed->fragment_size;
     }
+}
 
-    free_package_list(first);
+/**
+ * @brief Release the compression streams of a connection
+ *
+ * @param conn Connection state
+ */
+static void connection_compression_end(connection *conn)
+{
+    if (!conn->compressed)
+        return;
 
-    return SUCCESS;
-}
\ No newline at end of file
+    deflateEnd(&conn->deflater);
+    inflateEnd(&conn->inflater);
+    free(conn->channel_output);
+
+    conn->channel_output = NULL;
+    conn->compressed = 0;
+}
+
+/**
+ * @brief Start the compression streams of a connection, both ends start
+ *        them when the options are applied so their dictionaries match
+ *
+ * @param conn Connection state
+ * @return int 0 if success, -1 if error
+ */
+static int connection_compression_init(connection *conn)
+{
+    memset(&conn->deflater, 0, sizeof(z_stream));
+    memset(&conn->inflater, 0, sizeof(z_stream));
+
+    if (deflateInit2(&conn->deflater, CONNECTION_COMPRESSION_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    if (inflateInit2(&conn->inflater, -15) != Z_OK)
+    {
+        deflateEnd(&conn->deflater);
+        return -1;
+    }
+
+    if (conn->options.channels && (conn->channel_output = malloc(conn->options.fragment_size)) == NULL)
+    {
+        deflateEnd(&conn->deflater);
+        inflateEnd(&conn->inflater);
+        return -1;
+    }
+
+    conn->compressed = 1;
+
+    return 0;
+}
+
+/**
+ * @brief Unmap the shared memory rings of a connection
+ *
+ * @param conn Connection state
+ */
+static void ring_unmap(connection *conn)
+{
+    if (!conn->ring_memory)
+        return;
+
+    munmap(conn->ring_memory, RING_MEMORY_SIZE);
+
+    close(conn->tx.data_fd);
+    close(conn->tx.space_fd);
+    close(conn->rx.data_fd);
+    close(conn->rx.space_fd);
+
+    conn->ring_memory = NULL;
+}
+
+/**
+ * @brief Release the io_uring backend of a connection, cancelling its
+ *        receive
+ *
+ * @param conn Connection state
+ */
+static void uring_release(connection *conn)
+{
+    if (!conn->io)
+        return;
+
+    uring_exit(&conn->io->tx);
+    uring_exit(&conn->io->rx);
+    free(conn->io);
+
+    conn->io = NULL;
+}
+
+/**
+ * @brief Move a connection to the io_uring backend: sends of a window go
+ *        out in one submission and a multishot receive keeps filling
+ *        provided buffers, so reading what already arrived costs no system
+ *        call. Connections that cannot set it up stay on blocking calls
+ *
+ * @param conn Connection state
+ * @param sockect_fd Socket file descriptor
+ */
+static void uring_setup(connection *conn, int sockect_fd)
+{
+    if ((conn->io = calloc(1, sizeof(connection_uring))) == NULL)
+        return;
+
+    conn->io->tx.fd = -1;
+    conn->io->rx.fd = -1;
+    conn->io->buffer = -1;
+
+    // The completion ring (twice the entries) holds a completion per buffer and the final one
+    if (uring_init(&conn->io->tx, URING_SENDS) != 0 || uring_init(&conn->io->rx, URING_BUFFERS) != 0 ||
+        uring_buffers_init(&conn->io->rx, URING_BUFFER_GROUP, URING_BUFFERS, URING_BUFFER_SIZE) != 0 ||
+        uring_prep_recv_multishot(&conn->io->rx, sockect_fd, URING_BUFFER_GROUP, 0) != 0 ||
+        uring_submit(&conn->io->rx, 0) != 0)
+    {
+        uring_release(conn);
+        return;
+    }
+
+    conn->io->armed = 1;
+}
+
+error_code connection_configure(int sockect_fd, const connection_options *options)
+{
+    if (sockect_fd < 0 || sockect_fd >= CONNECTION_CHUNK_SIZE * CONNECTION_CHUNKS)
+        return ERROR_SOCKET_CONNECTION;
+
+    pthread_mutex_lock(&connection_table_mutex);
+
+    connection** chunk = connection_table[sockect_fd / CONNECTION_CHUNK_SIZE];
+
+    if (!chunk)
+    {
+        chunk = calloc(CONNECTION_CHUNK_SIZE, sizeof(connection*));
+        __atomic_store_n(&connection_table[sockect_fd / CONNECTION_CHUNK_SIZE], chunk, __ATOMIC_RELEASE);
+    }
+
+    connection* conn = chunk[sockect_fd % CONNECTION_CHUNK_SIZE];
+
+    // Acknowledgement frames are tiny, do not let Nagle hold them back
+    if (options->format == WIRE_FORMAT_BINARY)
+    {
+        int nodelay = 1;
+        struct sockaddr_storage address;
+        socklen_t address_length = sizeof(address);
+
+        if (getsockname(sockect_fd, (struct sockaddr*) &address, &address_length) == 0 && address.ss_family != AF_UNIX)
+            setsockopt(sockect_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+
+    if (!conn)
+    {
+        if ((conn = calloc(1, sizeof(connection))) == NULL)
+        {
+            pthread_mutex_unlock(&connection_table_mutex);
+
+            return ERROR_SOCKET_CONNECTION;
+        }
+
+        pthread_mutex_init(&conn->write_mutex, NULL);
+
+        conn->options = *options;
+
+        // The multishot receive takes all input once armed, the shared memory setup reads the socket itself
+        if (options->transport == TRANSPORT_SOCKET && uring_enabled())
+            uring_setup(conn, sockect_fd);
+
+        __atomic_store_n(&chunk[sockect_fd % CONNECTION_CHUNK_SIZE], conn, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        connection_compression_end(conn);
+        conn->options = *options;
+    }
+
+    if (options->compression == COMPRESSION_DEFLATE && connection_compression_init(conn) != 0)
+    {
+        pthread_mutex_unlock(&connection_table_mutex);
+
+        return ERROR_SOCKET_CONNECTION;
+    }
+
+    pthread_mutex_unlock(&connection_table_mutex);
+
+    return SUCCESS;
+}
+
+void connection_release(int sockect_fd)
+{
+    if (sockect_fd < 0 || sockect_fd >= CONNECTION_CHUNK_SIZE * CONNECTION_CHUNKS)
+        return;
+
+    pthread_mutex_lock(&connection_table_mutex);
+
+    connection** chunk = connection_table[sockect_fd / CONNECTION_CHUNK_SIZE];
+
+    if (chunk && chunk[sockect_fd % CONNECTION_CHUNK_SIZE])
+    {
+        connection_compression_end(chunk[sockect_fd % CONNECTION_CHUNK_SIZE]);
+        ring_unmap(chunk[sockect_fd % CONNECTION_CHUNK_SIZE]);
+        uring_release(chunk[sockect_fd % CONNECTION_CHUNK_SIZE]);
+
+        for (uint32_t i = 0; i < chunk[sockect_fd % CONNECTION_CHUNK_SIZE]->bulk_fd_count; i++)
+            close(chunk[sockect_fd % CONNECTION_CHUNK_SIZE]->bulk_fds[i]);
+
+        pthread_mutex_destroy(&chunk[sockect_fd % CONNECTION_CHUNK_SIZE]->write_mutex);
+        free(chunk[sockect_fd % CONNECTION_CHUNK_SIZE]->input);
+        free(chunk[sockect_fd % CONNECTION_CHUNK_SIZE]);
+        __atomic_store_n(&chunk[sockect_fd % CONNECTION_CHUNK_SIZE], NULL, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&connection_table_mutex);
+}
+
+int connection_idle(int sockect_fd)
+{
+    connection* conn = connection_get(sockect_fd);
+
+    if (!conn)
+        return 0;
+
+    if (conn->input_start < conn->input_end)
+        return 1;
+
+    // An idle connection keeps no buffer, the next read-ahead allocates it again
+    free(conn->input);
+
+    conn->input = NULL;
+    conn->input_start = 0;
+    conn->input_end = 0;
+
+    return 0;
+}
+
+int connection_pollable(int sockect_fd)
+{
+    connection* conn = connection_get(sockect_fd);
+
+    return !conn || (!conn->ring_memory && !conn->io);
+}
+
+/**
+ * @brief Create the wakeup event descriptor
+ *
+ */
+static void wakeup_init(void)
+{
+    __atomic_store_n(&wakeup_fd, eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), __ATOMIC_SEQ_CST);
+}
+
+void communication_wakeup(void)
+{
+    uint64_t one = 1;
+    int fd = __atomic_load_n(&wakeup_fd, __ATOMIC_SEQ_CST);
+
+    // Without descriptor nobody is waiting yet, the next wait checks the flag first
+    if (fd >= 0 && write(fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+int communication_wakeup_fd(void)
+{
+    pthread_once(&wakeup_once, wakeup_init);
+
+    return __atomic_load_n(&wakeup_fd, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Check whether a ring has data to read or space to write. A ring
+ *        whose indexes the peer broke counts as ready, the caller then
+ *        finds them broken and fails
+ *
+ * @param r Ring
+ * @param want_data 1 to check for data, 0 for space
+ * @return int 1 if ready
+ */
+static int ring_ready(const ring *r, int want_data)
+{
+    uint64_t used = __atomic_load_n(&r->control->tail, __ATOMIC_SEQ_CST) - __atomic_load_n(&r->control->head, __ATOMIC_SEQ_CST);
+
+    if (used > CONNECTION_RING_SIZE)
+        return 1;
+
+    return want_data ? used > 0 : used < CONNECTION_RING_SIZE;
+}
+
+/**
+ * @brief Wait until a ring has data to read or space to write. The waiting
+ *        flag is raised before checking the ring again, so the other end
+ *        either sees it and writes the event or its update is seen here
+ *
+ * @param sockect_fd Socket of the connection, readable once the peer closes it
+ * @param r Ring
+ * @param want_data 1 to wait for data, 0 for space
+ * @param end_flag End test flag
+ * @return error_code SUCCESS, END_SIGNAL or ERROR_SOCKET_DISCONNECT
+ */
+static error_code ring_wait(int sockect_fd, ring *r, int want_data, volatile sig_atomic_t *end_flag)
+{
+    uint32_t* waiting = want_data ? &r->control->reader_waiting : &r->control->writer_waiting;
+    struct pollfd fds[3] = 
+    {
+        { .fd = want_data ? r->data_fd : r->space_fd, .events = POLLIN },
+        { .fd = sockect_fd, .events = POLLIN },
+        { .fd = end_flag ? communication_wakeup_fd() : -1, .events = POLLIN }
+    };
+    uint64_t count;
+
+    for (int i = 0; i < RING_SPIN && !(end_flag && *end_flag); i++)
+    {
+        if (ring_ready(r, want_data))
+            return SUCCESS;
+
+        sched_yield();
+    }
+
+    while (1)
+    {
+        if(end_flag && *end_flag)
+            return END_SIGNAL;
+
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+
+        if (ring_ready(r, want_data))
+        {
+            __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+            return SUCCESS;
+        }
+
+        int polled = poll(fds, 3, -1);
+
+        __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+
+        if (polled < 0 && errno != EINTR)
+            return ERROR_SOCKET_RECEIVE;
+
+        if (polled <= 0)
+            continue;
+
+        if (fds[0].revents && read(fds[0].fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            return ERROR_SOCKET_RECEIVE;
+
+        // Nothing is sent on the socket once the rings are set up, it only becomes readable when the peer closes it
+        if (fds[1].revents && !ring_ready(r, want_data))
+            return ERROR_SOCKET_DISCONNECT;
+
+        // Woken up for an end flag other than ours, stop watching
+        if (fds[2].revents && !(end_flag && *end_flag))
+            fds[2].fd = -1;
+    }
+}
+
+/**
+ * @brief Publish bytes written to a ring and wake up its consumer if it waits
+ *
+ * @param r Ring
+ * @param tail New tail
+ */
+static void ring_publish(ring *r, uint64_t tail)
+{
+    uint64_t one = 1;
+
+    __atomic_store_n(&r->control->tail, tail, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&r->control->reader_waiting, __ATOMIC_SEQ_CST) && write(r->data_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+/**
+ * @brief Write every byte of a scatter list to a ring, waiting for space
+ *        when it is full
+ *
+ * @param sockect_fd Socket of the connection
+ * @param r Ring
+ * @param iov Buffers to write
+ * @param iovcnt Number of buffers
+ * @return error_code Error code
+ */
+static error_code ring_send(int sockect_fd, ring *r, const struct iovec *iov, int iovcnt)
+{
+    uint64_t tail = __atomic_load_n(&r->control->tail, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char* data = iov[i].iov_base;
+        size_t remaining = iov[i].iov_len;
+
+        while (remaining > 0)
+        {
+            uint64_t used = tail - __atomic_load_n(&r->control->head, __ATOMIC_ACQUIRE);
+
+            // The head is in memory the peer writes, never trust it to be behind the tail
+            if (used > CONNECTION_RING_SIZE)
+                return ERROR_SOCKET_DISCONNECT;
+
+            size_t space = CONNECTION_RING_SIZE - (size_t) used;
+
+            if (space == 0)
+            {
+                error_code result;
+
+                ring_publish(r, tail);
+
+                if ((result = ring_wait(sockect_fd, r, 0, NULL)) != SUCCESS)
+                    return result;
+
+                continue;
+            }
+
+            size_t count = remaining < space ? remaining : space;
+            size_t offset = (size_t) tail & (CONNECTION_RING_SIZE - 1);
+            size_t first = count < CONNECTION_RING_SIZE - offset ? count : CONNECTION_RING_SIZE - offset;
+
+            memcpy(r->data + offset, data, first);
+            memcpy(r->data, data + first, count - first);
+
+            tail += count;
+            data += count;
+            remaining -= count;
+        }
+    }
+
+    ring_publish(r, tail);
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Read exactly length bytes from a ring, waiting for data when it is
+ *        empty
+ *
+ * @param sockect_fd Socket of the connection
+ * @param r Ring
+ * @param buffer Destination buffer
+ * @param length Bytes to read
+ * @return error_code Error code
+ */
+static error_code ring_recv(int sockect_fd, ring *r, void *buffer, size_t length)
+{
+    uint64_t head = __atomic_load_n(&r->control->head, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+    size_t received = 0;
+
+    while (received < length)
+    {
+        uint64_t used = __atomic_load_n(&r->control->tail, __ATOMIC_ACQUIRE) - head;
+
+        // The tail is in memory the peer writes, never trust it to be within a ring of the head
+        if (used > CONNECTION_RING_SIZE)
+            return ERROR_SOCKET_DISCONNECT;
+
+        size_t available = (size_t) used;
+
+        if (available == 0)
+        {
+            error_code result;
+
+            if ((result = ring_wait(sockect_fd, r, 1, NULL)) != SUCCESS)
+                return result;
+
+            continue;
+        }
+
+        size_t count = length - received < available ? length - received : available;
+        size_t offset = (size_t) head & (CONNECTION_RING_SIZE - 1);
+        size_t first = count < CONNECTION_RING_SIZE - offset ? count : CONNECTION_RING_SIZE - offset;
+
+        memcpy((char*) buffer + received, r->data + offset, first);
+        memcpy((char*) buffer + received + first, r->data, count - first);
+
+        head += count;
+        received += count;
+
+        __atomic_store_n(&r->control->head, head, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&r->control->writer_waiting, __ATOMIC_SEQ_CST) && write(r->space_fd, &one, sizeof(one)) < 0)
+            return ERROR_SOCKET_RECEIVE;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Map the shared memory rings of a connection. The creator writes to
+ *        the first ring and reads from the second, the peer the other way
+ *
+ * @param conn Connection state
+ * @param fds Memory descriptor and the data and space events of both rings
+ * @param creator 1 on the end that created the rings
+ * @return int 0 if success, -1 if error
+ */
+static int ring_map(connection *conn, const int *fds, int creator)
+{
+    char* memory = mmap(NULL, RING_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+
+    if (memory == MAP_FAILED)
+        return -1;
+
+    ring rings[2] = 
+    {
+        { (ring_control*) memory, memory + RING_DATA_OFFSET, fds[1], fds[2] },
+        { (ring_control*) memory + 1, memory + RING_DATA_OFFSET + CONNECTION_RING_SIZE, fds[3], fds[4] }
+    };
+
+    // The mapping keeps the memory alive
+    close(fds[0]);
+
+    conn->tx = rings[creator ? 0 : 1];
+    conn->rx = rings[creator ? 1 : 0];
+    conn->ring_memory = memory;
+
+    return 0;
+}
+
+error_code connection_ring_create(int sockect_fd)
+{
+    connection* conn = connection_get(sockect_fd);
+    int fds[RING_FDS];
+    int created = 0;
+    char control[CMSG_SPACE(sizeof(fds))];
+    char byte = 0;
+
+    if (!conn || conn->ring_memory || (fds[0] = memfd_create("ipc-ring", MFD_CLOEXEC)) < 0)
+        return ERROR_SOCKET_CONNECTION;
+
+    created = 1;
+
+    if (ftruncate(fds[0], (off_t) RING_MEMORY_SIZE) == 0)
+        while (created < RING_FDS && (fds[created] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0)
+            created++;
+
+    if (created < RING_FDS)
+    {
+        for (int i = 0; i < created; i++)
+            close(fds[i]);
+
+        return ERROR_SOCKET_CONNECTION;
+    }
+
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+
+    memset(control, 0, sizeof(control));
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // The peer owns its copies once they are sent
+    if (sendmsg(sockect_fd, &msg, MSG_NOSIGNAL) != 1 || ring_map(conn, fds, 1) != 0)
+    {
+        for (int i = 0; i < RING_FDS; i++)
+            close(fds[i]);
+
+        return ERROR_SOCKET_CONNECTION;
+    }
+
+    return SUCCESS;
+}
+
+error_code connection_ring_attach(int sockect_fd)
+{
+    connection* conn = connection_get(sockect_fd);
+    int fds[RING_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    char byte;
+    ssize_t received;
+
+    if (!conn || conn->ring_memory)
+        return ERROR_SOCKET_CONNECTION;
+
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+
+    while ((received = recvmsg(sockect_fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+
+    struct cmsghdr* cmsg = received == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return received == 0 ? ERROR_SOCKET_DISCONNECT : ERROR_SOCKET_CONNECTION;
+
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    if (ring_map(conn, fds, 0) != 0)
+    {
+        for (int i = 0; i < RING_FDS; i++)
+            close(fds[i]);
+
+        return ERROR_SOCKET_CONNECTION;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Release the pool of a finished thread
+ *
+ * @param arg Pool
+ */
+static void pool_destroy(void *arg)
+{
+    pool* thread_pool = (pool*) arg;
+
+    for (int i = 0; i < POOL_CLASSES; i++)
+    {
+        while (thread_pool->free[i])
+        {
+            pool_block* block = thread_pool->free[i];
+
+            thread_pool->free[i] = block->next;
+            free(block);
+        }
+    }
+
+    free(thread_pool);
+}
+
+/**
+ * @brief Create the thread pool key
+ *
+ */
+static void pool_init(void)
+{
+    pthread_key_create(&pool_key, pool_destroy);
+}
+
+/**
+ * @brief Get the pool of the calling thread
+ *
+ * @return pool* Pool, NULL if it could not be created
+ */
+static pool* pool_get(void)
+{
+    pthread_once(&pool_once, pool_init);
+
+    pool* thread_pool = pthread_getspecific(pool_key);
+
+    if (!thread_pool && (thread_pool = calloc(1, sizeof(pool))) != NULL && pthread_setspecific(pool_key, thread_pool) != 0)
+    {
+        free(thread_pool);
+        thread_pool = NULL;
+    }
+
+    return thread_pool;
+}
+
+/**
+ * @brief Allocate a block from the thread pool (not initialized)
+ *
+ * @param class Block class
+ * @return void* Block, NULL on failure
+ */
+static void* pool_alloc(pool_class class)
+{
+    pool* thread_pool = pool_get();
+
+    if (thread_pool && thread_pool->free[class])
+    {
+        pool_block* block = thread_pool->free[class];
+
+        thread_pool->free[class] = block->next;
+        thread_pool->cached[class]--;
+
+        return block;
+    }
+
+    return malloc(pool_block_size[class]);
+}
+
+/**
+ * @brief Return a block to the thread pool
+ *
+ * @param class Block class
+ * @param block Block (may be NULL)
+ */
+static void pool_free(pool_class class, void *block)
+{
+    if (!block)
+        return;
+
+    pool* thread_pool = pool_get();
+
+    if (!thread_pool || thread_pool->cached[class] >= pool_max_cached[class])
+    {
+        free(block);
+        return;
+    }
+
+    ((pool_block*) block)->next = thread_pool->free[class];
+    thread_pool->free[class] = block;
+    thread_pool->cached[class]++;
+}
+
+/**
+ * @brief Store a 16 bits value in network byte order
+ *
+ * @param buffer Destination
+ * @param value Value
+ */
+static void put_u16(uint8_t *buffer, uint16_t value)
+{
+    buffer[0] = (uint8_t) (value >> 8);
+    buffer[1] = (uint8_t) value;
+}
+
+/**
+ * @brief Store a 32 bits value in network byte order
+ *
+ * @param buffer Destination
+ * @param value Value
+ */
+static void put_u32(uint8_t *buffer, uint32_t value)
+{
+    put_u16(buffer, (uint16_t) (value >> 16));
+    put_u16(buffer + 2, (uint16_t) value);
+}
+
+/**
+ * @brief Store a 64 bits value in network byte order
+ *
+ * @param buffer Destination
+ * @param value Value
+ */
+static void put_u64(uint8_t *buffer, uint64_t value)
+{
+    put_u32(buffer, (uint32_t) (value >> 32));
+    put_u32(buffer + 4, (uint32_t) value);
+}
+
+/**
+ * @brief Load a 16 bits value in network byte order
+ *
+ * @param buffer Source
+ * @return uint16_t Value
+ */
+static uint16_t get_u16(const uint8_t *buffer)
+{
+    return (uint16_t) (buffer[0] << 8 | buffer[1]);
+}
+
+/**
+ * @brief Load a 32 bits value in network byte order
+ *
+ * @param buffer Source
+ * @return uint32_t Value
+ */
+static uint32_t get_u32(const uint8_t *buffer)
+{
+    return (uint32_t) get_u16(buffer) << 16 | get_u16(buffer + 2);
+}
+
+/**
+ * @brief Load a 64 bits value in network byte order
+ *
+ * @param buffer Source
+ * @return uint64_t Value
+ */
+static uint64_t get_u64(const uint8_t *buffer)
+{
+    return (uint64_t) get_u32(buffer) << 32 | get_u32(buffer + 4);
+}
+
+/**
+ * @brief Wait for the sends queued on the io_uring backend to complete
+ *
+ * @param io io_uring backend state
+ * @return error_code First error of the batch
+ */
+static error_code uring_flush(connection_uring *io)
+{
+    error_code result = SUCCESS;
+    uint64_t length;
+    int32_t res;
+    uint32_t flags;
+
+    // Sends are linked, a failed one cancels the rest of the batch
+    while (io->pending > 0)
+    {
+        if (!uring_next(&io->tx, &length, &res, &flags))
+        {
+            // Submits what is queued and waits, the data stays in use until it completes
+            if (uring_submit(&io->tx, io->pending) < 0)
+            {
+                io->pending = 0;
+                return ERROR_SOCKET_SEND;
+            }
+
+            continue;
+        }
+
+        io->pending--;
+
+        if (result != SUCCESS || (res >= 0 && (uint64_t) res == length))
+            continue;
+
+        result = res == -EPIPE || res == -ECONNRESET ? ERROR_SOCKET_DISCONNECT : ERROR_SOCKET_SEND;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Queue a send on the io_uring backend. The header is copied, the
+ *        data must stay valid until uring_flush
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param io io_uring backend state
+ * @param header Header bytes (up to BINARY_HEADER_SIZE)
+ * @param header_size Header size
+ * @param data Data following the header
+ * @param data_size Data size
+ * @return error_code Error code
+ */
+static error_code uring_queue(int sockect_fd, connection_uring *io, const uint8_t *header, size_t header_size, const char *data, size_t data_size)
+{
+    error_code result;
+
+    if (io->pending == URING_SENDS && (result = uring_flush(io)) != SUCCESS)
+        return result;
+
+    uring_send* send = &io->sends[io->pending];
+
+    memcpy(send->header, header, header_size);
+    memset(&send->msg, 0, sizeof(struct msghdr));
+
+    send->iov[0].iov_base = send->header;
+    send->iov[0].iov_len = header_size;
+    send->iov[1].iov_base = (void*) data;
+    send->iov[1].iov_len = data_size;
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = data_size ? 2 : 1;
+
+    // MSG_WAITALL makes the kernel retry short sends, so each completion covers the whole frame
+    if (uring_prep_sendmsg(&io->tx, sockect_fd, &send->msg, MSG_NOSIGNAL | MSG_WAITALL, 1, header_size + data_size) != 0)
+        return ERROR_SOCKET_SEND;
+
+    io->pending++;
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Take the next receive completion of the io_uring backend,
+ *        waiting for it if none arrived yet
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param io io_uring backend state
+ * @return error_code Error code
+ */
+static error_code uring_receive_next(int sockect_fd, connection_uring *io)
+{
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+
+    while (io->closed == SUCCESS)
+    {
+        if (!uring_next(&io->rx, &user_data, &res, &flags))
+        {
+            if (!io->armed)
+            {
+                if (uring_prep_recv_multishot(&io->rx, sockect_fd, URING_BUFFER_GROUP, 0) != 0)
+                    return ERROR_SOCKET_RECEIVE;
+
+                io->armed = 1;
+            }
+
+            if (uring_submit(&io->rx, 1) < 0)
+                return ERROR_SOCKET_RECEIVE;
+
+            continue;
+        }
+
+        if (!(flags & URING_CQE_MORE))
+            io->armed = 0;
+
+        if (res > 0 && (flags & URING_CQE_BUFFER))
+        {
+            io->buffer = (int32_t) (flags >> URING_CQE_BUFFER_SHIFT);
+            io->buffer_start = 0;
+            io->buffer_end = (size_t) res;
+
+            return SUCCESS;
+        }
+
+        // Out of buffers: every buffer filled before was read and given back, arm it again
+        if (res == -ENOBUFS)
+            continue;
+
+        if (res == 0 || res == -ECONNRESET)
+            io->closed = ERROR_SOCKET_DISCONNECT;
+        else
+            io->closed = ERROR_SOCKET_RECEIVE;
+    }
+
+    return io->closed;
+}
+
+/**
+ * @brief Receive exactly length bytes from the provided buffers of the
+ *        io_uring backend, giving each buffer back once it is read
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param io io_uring backend state
+ * @param buffer Destination buffer
+ * @param length Bytes to receive
+ * @return error_code Error code
+ */
+static error_code uring_recv(int sockect_fd, connection_uring *io, void *buffer, size_t length)
+{
+    size_t received = 0;
+    error_code result;
+
+    while (received < length)
+    {
+        if (io->buffer < 0)
+        {
+            if ((result = uring_receive_next(sockect_fd, io)) != SUCCESS)
+                return result;
+
+            continue;
+        }
+
+        size_t count = io->buffer_end - io->buffer_start;
+
+        if (count > length - received)
+            count = length - received;
+
+        memcpy((char*) buffer + received, uring_buffer(&io->rx, (uint16_t) io->buffer) + io->buffer_start, count);
+
+        io->buffer_start += count;
+        received += count;
+
+        if (io->buffer_start == io->buffer_end)
+        {
+            uring_buffer_recycle(&io->rx, (uint16_t) io->buffer);
+            io->buffer = -1;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Wait until the io_uring backend has data to read. The io_uring
+ *        descriptor is readable while completions wait to be taken
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param io io_uring backend state
+ * @param end_flag End test flag
+ * @return error_code SUCCESS, END_SIGNAL or ERROR_SOCKET_RECEIVE
+ */
+static error_code uring_wait(int sockect_fd, connection_uring *io, volatile sig_atomic_t *end_flag)
+{
+    struct pollfd fds[2] = 
+    {
+        { .fd = io->rx.fd, .events = POLLIN },
+        { .fd = end_flag ? communication_wakeup_fd() : -1, .events = POLLIN }
+    };
+
+    while (1)
+    {
+        if(end_flag && *end_flag)
+            return END_SIGNAL;
+
+        // Errors and the end of the socket are reported by the read that follows
+        if (io->buffer >= 0 || io->closed != SUCCESS || uring_ready(&io->rx))
+            return SUCCESS;
+
+        if (!io->armed)
+        {
+            if (uring_prep_recv_multishot(&io->rx, sockect_fd, URING_BUFFER_GROUP, 0) != 0 || uring_submit(&io->rx, 0) < 0)
+                return ERROR_SOCKET_RECEIVE;
+
+            io->armed = 1;
+        }
+
+        // Blocks until a completion arrives or communication_wakeup is called
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            return ERROR_SOCKET_RECEIVE;
+
+        // Readable with an empty completion ring: completions overflowed
+        if (fds[0].revents && !uring_ready(&io->rx) && uring_submit(&io->rx, 0) < 0)
+            return ERROR_SOCKET_RECEIVE;
+
+        // Woken up for an end flag other than ours, stop watching
+        if (fds[1].revents && !(end_flag && *end_flag))
+            fds[1].fd = -1;
+    }
+}
+
+/**
+ * @brief Send all bytes described by an iovec array
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param iov Buffers to send (modified)
+ * @param iovcnt Number of buffers
+ * @return error_code Error code
+ */
+static error_code send_all(int sockect_fd, struct iovec *iov, int iovcnt)
+{
+    connection* conn = connection_get(sockect_fd);
+    struct msghdr msg;
+
+    if (conn && conn->ring_memory)
+        return ring_send(sockect_fd, &conn->tx, iov, iovcnt);
+
+    // Queued frames go first
+    if (conn && conn->io && conn->io->pending)
+    {
+        error_code result = uring_flush(conn->io);
+
+        if (result != SUCCESS)
+            return result;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t) iovcnt;
+
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t sent = sendmsg(sockect_fd, &msg, MSG_NOSIGNAL);
+
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return errno == EPIPE || errno == ECONNRESET ? ERROR_SOCKET_DISCONNECT : ERROR_SOCKET_SEND;
+        }
+
+        size_t remaining = (size_t) sent;
+
+        while (msg.msg_iovlen > 0 && remaining >= msg.msg_iov->iov_len)
+        {
+            remaining -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + remaining;
+            msg.msg_iov->iov_len -= remaining;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Receive what is available, up to length bytes. On connections
+ *        with bulk transfers the memory files passed along with the bytes
+ *        are kept in order until their frames are read
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param conn Connection state, NULL if not configured
+ * @param buffer Destination buffer
+ * @param length Max bytes to receive
+ * @return ssize_t Bytes received, 0 on disconnection, -1 if error
+ */
+static ssize_t recv_input(int sockect_fd, connection *conn, void *buffer, size_t length)
+{
+    int fds[BULK_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
+
+    if (!conn || !conn->options.bulk)
+        return recv(sockect_fd, buffer, length, 0);
+
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t received = recvmsg(sockect_fd, &msg, MSG_CMSG_CLOEXEC);
+
+    for (struct cmsghdr* cmsg = received > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+
+        // More files than frames can use is a broken peer, its frames will find none
+        for (size_t i = 0; i < count; i++)
+        {
+            if (conn->bulk_fd_count < BULK_FDS)
+                conn->bulk_fds[conn->bulk_fd_count++] = fds[i];
+            else
+                close(fds[i]);
+        }
+    }
+
+    return received;
+}
+
+/**
+ * @brief Receive exactly length bytes. Configured connections read ahead
+ *        into their input buffer, so frames coalesced in one read cost one
+ *        system call; reads of a whole buffer or more go straight to the
+ *        destination
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param buffer Destination buffer
+ * @param length Bytes to receive
+ * @return error_code Error code
+ */
+static error_code recv_all(int sockect_fd, void *buffer, size_t length)
+{
+    connection* conn = connection_get(sockect_fd);
+    size_t received = 0;
+
+    if (conn && conn->ring_memory)
+        return ring_recv(sockect_fd, &conn->rx, buffer, length);
+
+    if (conn && conn->io)
+        return uring_recv(sockect_fd, conn->io, buffer, length);
+
+    while (received < length)
+    {
+        if (conn && conn->input_start < conn->input_end)
+        {
+            size_t count = conn->input_end - conn->input_start;
+
+            if (count > length - received)
+                count = length - received;
+
+            memcpy((char*) buffer + received, conn->input + conn->input_start, count);
+
+            conn->input_start += count;
+            received += count;
+
+            continue;
+        }
+
+        int direct = !conn || length - received >= CONNECTION_INPUT_SIZE;
+        ssize_t result;
+
+        if (!direct && !conn->input && (conn->input = malloc(CONNECTION_INPUT_SIZE)) == NULL)
+            return ERROR_SOCKET_RECEIVE;
+
+        if (direct)
+            result = recv_input(sockect_fd, conn, (char*) buffer + received, length - received);
+        else
+            result = recv_input(sockect_fd, conn, conn->input, CONNECTION_INPUT_SIZE);
+
+        if (result == 0)
+            return ERROR_SOCKET_DISCONNECT;
+
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return errno == ECONNRESET ? ERROR_SOCKET_DISCONNECT : ERROR_SOCKET_RECEIVE;
+        }
+
+        if (direct)
+            received += (size_t) result;
+        else
+        {
+            conn->input_start = 0;
+            conn->input_end = (size_t) result;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Receive and drop length bytes
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param length Bytes to drop
+ * @return error_code Error code
+ */
+static error_code recv_discard(int sockect_fd, size_t length)
+{
+    char discard[DATA_FRAGMENT_SIZE];
+    error_code result = SUCCESS;
+
+    while (length > 0 && result == SUCCESS)
+    {
+        size_t count = length < sizeof(discard) ? length : sizeof(discard);
+
+        result = recv_all(sockect_fd, discard, count);
+        length -= count;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Generate checksum
+ *
+ * @param data Data to generate checksum
+ * @param length Data length
+ * @return int Checksum
+ */
+int generate_checksum(void *data, size_t length) 
+{
+    return (int)~checksum_update(0xffffffff, data, length);
+}
+
+/**
+ * @brief Validate checksum
+ *
+ * @param data Data to validate checksum
+ * @param length Data length
+ * @param checksum Checksum
+ * @return int Checksum
+ */
+int validate_checksum(void *data, size_t length, int checksum) 
+{
+    return generate_checksum(data, length) == checksum;
+}
+
+/**
+ * @brief Build JSON byte tables
+ *
+ */
+static void json_tables_init(void)
+{
+    for (int i = 0; i < 256; i++)
+        json_byte_width[i] = (uint8_t) snprintf(json_byte_text[i], JSON_ENCODE_SLACK, ",%d", (signed char) i);
+
+    for (int i = 0; i < 4096; i++)
+    {
+        base64_pair[i][0] = base64_alphabet[i >> 6];
+        base64_pair[i][1] = base64_alphabet[i & 0x3F];
+    }
+
+    memset(base64_value, BASE64_INVALID, sizeof(base64_value));
+
+    for (int i = 0; i < 64; i++)
+        base64_value[(uint8_t) base64_alphabet[i]] = (uint8_t) i;
+}
+
+/**
+ * @brief Encode bytes to base64, three bytes (two table entries) at a time
+ *
+ * @param data Data to encode
+ * @param size Data size
+ * @param text Output buffer, must hold (size + 2) / 3 * 4 bytes
+ * @return size_t Encoded length
+ */
+static size_t base64_encode(const uint8_t* data, size_t size, char* text)
+{
+    char* out = text;
+    size_t i = 0;
+
+    for (; i + 3 <= size; i += 3, out += 4)
+    {
+        uint32_t value = (uint32_t) data[i] << 16 | (uint32_t) data[i + 1] << 8 | data[i + 2];
+
+        memcpy(out, base64_pair[value >> 12], 2);
+        memcpy(out + 2, base64_pair[value & 0xFFF], 2);
+    }
+
+    if (i < size)
+    {
+        uint32_t value = (uint32_t) data[i] << 16 | (i + 1 < size ? (uint32_t) data[i + 1] << 8 : 0);
+
+        memcpy(out, base64_pair[value >> 12], 2);
+        out[2] = i + 1 < size ? base64_pair[value & 0xFFF][0] : '=';
+        out[3] = '=';
+        out += 4;
+    }
+
+    return (size_t) (out - text);
+}
+
+/**
+ * @brief Decode base64 text, four characters at a time
+ *
+ * @param text Text to decode
+ * @param length Text length (multiple of 4)
+ * @param data Output buffer
+ * @param capacity Output buffer size
+ * @param count Number of bytes decoded
+ * @return int 1 if decoded, 0 if malformed or too long
+ */
+static int base64_decode(const char* text, size_t length, char* data, size_t capacity, size_t* count)
+{
+    const uint8_t* in = (const uint8_t*) text;
+    size_t padding = 0;
+    size_t size;
+
+    if (length % 4)
+        return 0;
+
+    if (length && in[length - 1] == '=')
+        padding = in[length - 2] == '=' ? 2 : 1;
+
+    if ((size = length / 4 * 3 - padding) > capacity)
+        return 0;
+
+    // Whole quads, the last one is decoded apart when padded
+    size_t quads = length / 4 - (padding ? 1 : 0);
+    uint8_t* out = (uint8_t*) data;
+
+    for (size_t i = 0; i < quads; i++, in += 4, out += 3)
+    {
+        uint8_t a = base64_value[in[0]], b = base64_value[in[1]], c = base64_value[in[2]], d = base64_value[in[3]];
+
+        // Valid values are below 64, BASE64_INVALID sets the high bit
+        if ((a | b | c | d) & 0x80)
+            return 0;
+
+        uint32_t value = (uint32_t) a << 18 | (uint32_t) b << 12 | (uint32_t) c << 6 | d;
+
+        out[0] = (uint8_t) (value >> 16);
+        out[1] = (uint8_t) (value >> 8);
+        out[2] = (uint8_t) value;
+    }
+
+    if (padding)
+    {
+        uint8_t a = base64_value[in[0]], b = base64_value[in[1]], c = padding == 1 ? base64_value[in[2]] : 0;
+
+        if ((a | b | c) & 0x80)
+            return 0;
+
+        uint32_t value = (uint32_t) a << 18 | (uint32_t) b << 12 | (uint32_t) c << 6;
+
+        out[0] = (uint8_t) (value >> 16);
+
+        if (padding == 1)
+            out[1] = (uint8_t) (value >> 8);
+    }
+
+    *count = size;
+
+    return 1;
+}
+
+/**
+ * @brief Get relative size of fragment payload
+ *
+ * @param data Data
+ * @param data_size Data size
+ * @param fragment_size Fragment size
+ * @return size_t Relative size
+ */
+size_t get_relative_size(char* data, size_t data_size, size_t fragment_size)
+{
+    size_t count = 0;
+    size_t acumulate = 0;
+
+    pthread_once(&json_tables_once, json_tables_init);
+
+    do
+        acumulate += json_byte_width[(uint8_t) data[count++]];
+    while (acumulate < fragment_size && count < data_size);
+
+    return count;
+}
+
+/**
+ * @brief Fragment data. Fragments are views into data, which must outlive them
+ *
+ * @param data Data to fragment
+ * @param data_size Data size
+ * @param fragment_size Fragment size
+ * @param payload Encoding of the data of the fragments
+ * @return fragments* First fragment
+ */
+fragments* fragment(char* data, size_t data_size, size_t fragment_size, json_payload payload)
+{
+    fragments* first = pool_alloc(POOL_FRAGMENT);
+    fragments* current = first;
+
+    memset(current, 0, sizeof(fragments));
+
+    current->next = NULL;
+    current->data = data;
+    current->total_size = data_size;
+
+    size_t remaining_data_size = data_size;
+    size_t current_data_size = 0;
+
+    while(remaining_data_size > 0)
+    {
+        if (payload == JSON_PAYLOAD_BASE64)
+            current_data_size = remaining_data_size > fragment_size / 4 * 3 ? fragment_size / 4 * 3 : remaining_data_size;
+        else
+            current_data_size = remaining_data_size > fragment_size ? get_relative_size(data + data_size - remaining_data_size, fragment_size, fragment_size) : get_relative_size(data + data_size - remaining_data_size, remaining_data_size, fragment_size);
+
+        current->data = data + data_size - remaining_data_size;
+        current->content_size = current_data_size;
+
+        current->checksum = generate_checksum(current->data, current->content_size);
+
+        remaining_data_size -= current_data_size;
+
+        if(remaining_data_size > 0)
+        {
+            current->last = 0;
+            current->next = pool_alloc(POOL_FRAGMENT);
+
+            memset(current->next, 0, sizeof(fragments));
+
+            current->next->total_size = current->total_size;
+            current->next->sequence = current->sequence + 1;
+
+            current = current->next; 
+
+            current->next = NULL;  
+        }
+    }
+
+    current->last = 1;
+
+    return first;
+}
+
+/**
+ * @brief Free fragment list
+ *
+ * @param first First fragment
+ */
+void free_package_list(fragments* first) 
+{
+    fragments* current = first;
+    fragments* aux;
+
+    while(current)
+    {
+        aux = current;
+        current = current->next;
+        pool_free(POOL_FRAGMENT, aux);
+    }
+}
+
+/**
+ * @brief Encode fragment to JSON
+ *
+ * @param package Fragment
+ * @param payload Encoding of the data field
+ * @param buffer Output buffer, must have JSON_ENCODE_SLACK bytes more than the JSON string
+ * @param buffer_size Output buffer size
+ * @return size_t JSON string length, 0 if the buffer is too small
+ */
+size_t encode_json(fragments* package, json_payload payload, char* buffer, size_t buffer_size)
+{
+    const uint8_t* data = (const uint8_t*) package->data;
+
+    pthread_once(&json_tables_once, json_tables_init);
+
+    int header = snprintf(buffer, buffer_size, "{\"checksum\":%d,\"total_size\":%zu,\"content_size\":%zu,\"last\":%u,\"data\":%c", 
+                          package->checksum, package->total_size, package->content_size, package->last, payload == JSON_PAYLOAD_BASE64 ? '"' : '[');
+
+    if (header < 0 || (size_t) header + JSON_ENCODE_SLACK > buffer_size)
+        return 0;
+
+    size_t offset = (size_t) header;
+
+    if (payload == JSON_PAYLOAD_BASE64)
+    {
+        if (offset + (package->content_size + 2) / 3 * 4 + 3 > buffer_size)
+            return 0;
+
+        offset += base64_encode(data, package->content_size, buffer + offset);
+
+        memcpy(buffer + offset, "\"}", 3);
+
+        return offset + 2;
+    }
+
+    // The first value is not preceded by a comma. Legacy encoders write one for empty fragments too ("[0]")
+    if (package->content_size > 0)
+    {
+        memcpy(buffer + offset, json_byte_text[data[0]] + 1, JSON_ENCODE_SLACK - 1);
+        offset += json_byte_width[data[0]] - 1u;
+    }
+    else
+        buffer[offset++] = '0';
+
+    for (size_t i = 1; i < package->content_size; i++)
+    {
+        if (offset + JSON_ENCODE_SLACK > buffer_size)
+            return 0;
+
+        memcpy(buffer + offset, json_byte_text[data[i]], JSON_ENCODE_SLACK);
+
+        offset += json_byte_width[data[i]];
+    }
+
+    if (offset + 3 > buffer_size)
+        return 0;
+
+    memcpy(buffer + offset, "]}", 3);
+
+    return offset + 2;
+}
+
+/**
+ * @brief Skip JSON white space
+ *
+ * @param cursor Parser cursor
+ */
+static void json_skip_space(json_cursor* cursor)
+{
+    while (cursor->ptr < cursor->end && (*cursor->ptr == ASCII_SPACE || *cursor->ptr == ASCII_LINE_BREAK || *cursor->ptr == '\t' || *cursor->ptr == '\r'))
+        cursor->ptr++;
+}
+
+/**
+ * @brief Consume an expected character
+ *
+ * @param cursor Parser cursor
+ * @param character Expected character
+ * @return int 1 if consumed, 0 otherwise
+ */
+static int json_expect(json_cursor* cursor, char character)
+{
+    json_skip_space(cursor);
+
+    if (cursor->ptr >= cursor->end || *cursor->ptr != character)
+        return 0;
+
+    cursor->ptr++;
+
+    return 1;
+}
+
+/**
+ * @brief Parse an integer value
+ *
+ * @param cursor Parser cursor
+ * @param min Minimum accepted value
+ * @param max Maximum accepted value
+ * @param value Parsed value
+ * @return int 1 if parsed, 0 if malformed or out of range
+ */
+static int json_parse_integer(json_cursor* cursor, int64_t min, uint64_t max, int64_t* value)
+{
+    uint64_t magnitude = 0;
+    uint64_t limit = max;
+    int negative = 0;
+    int digits = 0;
+
+    json_skip_space(cursor);
+
+    if (cursor->ptr < cursor->end && *cursor->ptr == ASCII_MIDDLE_DASH)
+    {
+        if (min >= 0)
+            return 0;
+
+        negative = 1;
+        limit = (uint64_t) -(min + 1) + 1;
+        cursor->ptr++;
+    }
+
+    while (cursor->ptr < cursor->end && *cursor->ptr >= '0' && *cursor->ptr <= '9')
+    {
+        uint64_t digit = (uint64_t) (*cursor->ptr++ - '0');
+
+        if (magnitude > limit / 10 || (magnitude == limit / 10 && digit > limit % 10))
+            return 0;
+
+        magnitude = magnitude * 10 + digit;
+        digits++;
+    }
+
+    if (!digits)
+        return 0;
+
+    if (negative)
+        *value = magnitude ? -(int64_t) (magnitude - 1) - 1 : 0;
+    else
+        *value = (int64_t) magnitude;
+
+    return 1;
+}
+
+/**
+ * @brief Parse an object key and the following colon
+ *
+ * @param cursor Parser cursor
+ * @param key Key buffer
+ * @param key_size Key buffer size
+ * @return int 1 if parsed, 0 if malformed
+ */
+static int json_parse_key(json_cursor* cursor, char* key, size_t key_size)
+{
+    size_t length = 0;
+
+    if (!json_expect(cursor, '"'))
+        return 0;
+
+    while (cursor->ptr < cursor->end && *cursor->ptr != '"')
+    {
+        if (*cursor->ptr == '\\' || length + 1 >= key_size)
+            return 0;
+
+        key[length++] = *cursor->ptr++;
+    }
+
+    if (cursor->ptr >= cursor->end)
+        return 0;
+
+    cursor->ptr++;
+    key[length] = ASCII_END_OF_STRING;
+
+    return json_expect(cursor, ':');
+}
+
+/**
+ * @brief Skip the value of an unknown key (number or string without escapes)
+ *
+ * @param cursor Parser cursor
+ * @return int 1 if skipped, 0 if malformed
+ */
+static int json_skip_value(json_cursor* cursor)
+{
+    int64_t ignored;
+
+    json_skip_space(cursor);
+
+    if (cursor->ptr < cursor->end && *cursor->ptr == '"')
+    {
+        char* close = memchr(cursor->ptr + 1, '"', (size_t) (cursor->end - cursor->ptr - 1));
+
+        if (!close || memchr(cursor->ptr + 1, '\\', (size_t) (close - cursor->ptr - 1)))
+            return 0;
+
+        cursor->ptr = close + 1;
+
+        return 1;
+    }
+
+    return json_parse_integer(cursor, INT64_MIN, INT64_MAX, &ignored);
+}
+
+/**
+ * @brief Parse the data array straight into the destination buffer
+ *
+ * @param cursor Parser cursor
+ * @param data Destination buffer
+ * @param capacity Destination buffer size
+ * @param count Number of bytes parsed
+ * @return int 1 if parsed, 0 if malformed or too long
+ */
+static int json_parse_data(json_cursor* cursor, char* data, size_t capacity, size_t* count)
+{
+    const char* ptr;
+    const char* end = cursor->end;
+    size_t length = 0;
+
+    if (!json_expect(cursor, '['))
+        return 0;
+
+    if (json_expect(cursor, ']'))
+    {
+        *count = 0;
+        return 1;
+    }
+
+    ptr = cursor->ptr;
+
+    while (1)
+    {
+        int negative = 0;
+        int value = 0;
+        int digits = 0;
+
+        while (ptr < end && (*ptr == ASCII_SPACE || *ptr == ASCII_LINE_BREAK || *ptr == '\t' || *ptr == '\r'))
+            ptr++;
+
+        if (ptr < end && *ptr == ASCII_MIDDLE_DASH)
+        {
+            negative = 1;
+            ptr++;
+        }
+
+        while (ptr < end && *ptr >= '0' && *ptr <= '9' && digits < 4)
+        {
+            value = value * 10 + (*ptr++ - '0');
+            digits++;
+        }
+
+        if (!digits || digits > 3 || value > 127 + negative || length == capacity)
+            return 0;
+
+        data[length++] = (char) (negative ? -value : value);
+
+        while (ptr < end && (*ptr == ASCII_SPACE || *ptr == ASCII_LINE_BREAK || *ptr == '\t' || *ptr == '\r'))
+            ptr++;
+
+        if (ptr >= end)
+            return 0;
+
+        if (*ptr == ']')
+            break;
+
+        if (*ptr++ != ',')
+            return 0;
+    }
+
+    cursor->ptr = ptr + 1;
+    *count = length;
+
+    return 1;
+}
+
+/**
+ * @brief Parse a base64 data string straight into the destination buffer
+ *
+ * @param cursor Parser cursor
+ * @param data Destination buffer
+ * @param capacity Destination buffer size
+ * @param count Number of bytes parsed
+ * @return int 1 if parsed, 0 if malformed or too long
+ */
+static int json_parse_base64(json_cursor* cursor, char* data, size_t capacity, size_t* count)
+{
+    if (!json_expect(cursor, '"'))
+        return 0;
+
+    const char* close = memchr(cursor->ptr, '"', (size_t) (cursor->end - cursor->ptr));
+
+    if (!close || !base64_decode(cursor->ptr, (size_t) (close - cursor->ptr), data, capacity, count))
+        return 0;
+
+    cursor->ptr = close + 1;
+
+    return 1;
+}
+
+/**
+ * @brief Decode JSON to fragment in a single forward pass
+ *
+ * @param json_string JSON string
+ * @param length JSON string maximum length (parsing stops at the closing brace)
+ * @param package Fragment to fill, data is written straight into package->data
+ * @return error_code SUCCESS or ERROR_FRAME_MALFORMED
+ */
+error_code decode_json(const char* json_string, size_t length, fragments* package)
+{
+    json_cursor cursor = { .ptr = json_string, .end = json_string + length };
+    unsigned int seen = 0;
+    size_t data_count = 0;
+    char key[16];
+    int64_t value;
+
+    if (!json_expect(&cursor, '{'))
+        return ERROR_FRAME_MALFORMED;
+
+    do
+    {
+        unsigned int current;
+
+        if (!json_parse_key(&cursor, key, sizeof(key)))
+            return ERROR_FRAME_MALFORMED;
+
+        if (strcmp(key, "checksum") == 0)
+        {
+            current = JSON_KEY_CHECKSUM;
+
+            if (!json_parse_integer(&cursor, INT32_MIN, INT32_MAX, &value))
+                return ERROR_FRAME_MALFORMED;
+
+            package->checksum = (int) value;
+        }
+        else if (strcmp(key, "total_size") == 0)
+        {
+            current = JSON_KEY_TOTAL_SIZE;
+
+            if (!json_parse_integer(&cursor, 0, SIZE_MAX > INT64_MAX ? INT64_MAX : SIZE_MAX, &value))
+                return ERROR_FRAME_MALFORMED;
+
+            package->total_size = (size_t) value;
+        }
+        else if (strcmp(key, "content_size") == 0)
+        {
+            current = JSON_KEY_CONTENT_SIZE;
+
+            if (!json_parse_integer(&cursor, 0, DATA_FRAGMENT_SIZE, &value))
+                return ERROR_FRAME_MALFORMED;
+
+            package->content_size = (size_t) value;
+        }
+        else if (strcmp(key, "last") == 0)
+        {
+            current = JSON_KEY_LAST;
+
+            if (!json_parse_integer(&cursor, 0, 1, &value))
+                return ERROR_FRAME_MALFORMED;
+
+            package->last = (uint8_t) value;
+        }
+        else if (strcmp(key, "data") == 0)
+        {
+            current = JSON_KEY_DATA;
+
+            json_skip_space(&cursor);
+
+            // Either encoding is accepted, whatever was negotiated
+            if (cursor.ptr < cursor.end && *cursor.ptr == '"')
+            {
+                if (!json_parse_base64(&cursor, package->data, DATA_FRAGMENT_SIZE, &data_count))
+                    return ERROR_FRAME_MALFORMED;
+            }
+            else if (!json_parse_data(&cursor, package->data, DATA_FRAGMENT_SIZE, &data_count))
+                return ERROR_FRAME_MALFORMED;
+        }
+        else
+        {
+            current = 0;
+
+            if (!json_skip_value(&cursor))
+                return ERROR_FRAME_MALFORMED;
+        }
+
+        if (seen & current)
+            return ERROR_FRAME_MALFORMED;
+
+        seen |= current;
+    } while (json_expect(&cursor, ','));
+
+    // Legacy encoders write one value for empty fragments
+    if (package->content_size == 0 && data_count == 1)
+        data_count = 0;
+
+    if (!json_expect(&cursor, '}') || seen != JSON_KEY_ALL || data_count != package->content_size)
+        return ERROR_FRAME_MALFORMED;
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Get the receive timeout of a socket (SO_RCVTIMEO)
+ *
+ * @param sockect_fd Socket file descriptor
+ * @return int Timeout in milliseconds, -1 if none
+ */
+static int socket_timeout(int sockect_fd)
+{
+    struct timeval timeout;
+    socklen_t length = sizeof(timeout);
+
+    if (getsockopt(sockect_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &length) != 0 || (timeout.tv_sec == 0 && timeout.tv_usec == 0))
+        return -1;
+
+    return timeout.tv_sec > INT32_MAX / 1000 ? INT32_MAX : (int) (timeout.tv_sec * 1000 + timeout.tv_usec / 1000);
+}
+
+/**
+ * @brief Wait until socket has data to read, for at most the receive
+ *        timeout of the socket
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param end_flag End test flag
+ * @return error_code SUCCESS, END_SIGNAL or ERROR_SOCKET_RECEIVE
+ */
+static error_code wait_readable(int sockect_fd, volatile sig_atomic_t *end_flag)
+{
+    connection* conn = connection_get(sockect_fd);
+    struct pollfd fds[2] = 
+    {
+        { .fd = sockect_fd, .events = POLLIN },
+        { .fd = end_flag ? communication_wakeup_fd() : -1, .events = POLLIN }
+    };
+    int timeout = -2;
+
+    if (conn && conn->ring_memory)
+        return ring_wait(sockect_fd, &conn->rx, 1, end_flag);
+
+    if (conn && conn->io)
+        return uring_wait(sockect_fd, conn->io, end_flag);
+
+    while (1)
+    {
+        if(end_flag && *end_flag)
+            return END_SIGNAL;
+
+        if (conn && conn->input_start < conn->input_end)
+            return SUCCESS;
+
+        // Read only when about to block, data is usually there already
+        if (timeout == -2)
+            timeout = socket_timeout(sockect_fd);
+
+        // Blocks until data arrives, communication_wakeup is called or the timeout expires
+        int polled = poll(fds, 2, timeout);
+
+        if ((polled < 0 && errno != EINTR) || polled == 0)
+            return ERROR_SOCKET_RECEIVE;
+
+        if (polled > 0 && fds[0].revents)
+            return SUCCESS;
+
+        // Woken up for an end flag other than ours, stop watching
+        if (fds[1].revents && !(end_flag && *end_flag))
+            fds[1].fd = -1;
+    }
+}
+
+/**
+ * @brief Encode a binary frame header
+ *
+ * @param header Frame header
+ * @param buffer Destination (BINARY_HEADER_SIZE bytes)
+ */
+static void encode_binary_header(const frame_header *header, uint8_t *buffer)
+{
+    put_u16(buffer, BINARY_FRAME_MAGIC);
+    buffer[2] = BINARY_FRAME_VERSION;
+    buffer[3] = header->flags;
+    put_u32(buffer + 4, header->sequence);
+    put_u32(buffer + 8, (uint32_t) header->checksum);
+    put_u32(buffer + 12, header->content_size);
+    put_u64(buffer + 16, header->total_size);
+}
+
+/**
+ * @brief Write a binary frame
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param header Frame header
+ * @param data Frame data (header->content_size bytes)
+ * @return error_code Error code
+ */
+static error_code write_binary_frame(int sockect_fd, const frame_header *header, const char *data)
+{
+    uint8_t buffer[BINARY_HEADER_SIZE];
+
+    encode_binary_header(header, buffer);
+
+    struct iovec iov[2] = 
+    {
+        { .iov_base = buffer, .iov_len = BINARY_HEADER_SIZE },
+        { .iov_base = (void*) data, .iov_len = header->content_size }
+    };
+
+    return send_all(sockect_fd, iov, header->content_size ? 2 : 1);
+}
+
+/**
+ * @brief Write a binary frame whose data stays valid until send_flush. On
+ *        the io_uring backend the frame is queued and a whole window goes
+ *        out in one submission, otherwise it is written right away
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param header Frame header
+ * @param data Frame data (header->content_size bytes)
+ * @return error_code Error code
+ */
+static error_code queue_binary_frame(int sockect_fd, const frame_header *header, const char *data)
+{
+    connection* conn = connection_get(sockect_fd);
+    uint8_t buffer[BINARY_HEADER_SIZE];
+
+    if (!conn || !conn->io)
+        return write_binary_frame(sockect_fd, header, data);
+
+    encode_binary_header(header, buffer);
+
+    return uring_queue(sockect_fd, conn->io, buffer, BINARY_HEADER_SIZE, data, header->content_size);
+}
+
+/**
+ * @brief Wait until the frames queued by queue_binary_frame are sent
+ *
+ * @param sockect_fd Socket file descriptor
+ * @return error_code Error code
+ */
+static error_code send_flush(int sockect_fd)
+{
+    connection* conn = connection_get(sockect_fd);
+
+    return conn && conn->io ? uring_flush(conn->io) : SUCCESS;
+}
+
+/**
+ * @brief Read and validate a binary frame header
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param max_content_size Max content size accepted
+ * @param header Frame header read
+ * @return error_code Error code
+ */
+static error_code read_binary_header(int sockect_fd, uint32_t max_content_size, frame_header *header)
+{
+    uint8_t buffer[BINARY_HEADER_SIZE];
+    error_code result = recv_all(sockect_fd, buffer, BINARY_HEADER_SIZE);
+
+    if (result != SUCCESS)
+        return result;
+
+    if (get_u16(buffer) != BINARY_FRAME_MAGIC || buffer[2] != BINARY_FRAME_VERSION || get_u32(buffer + 12) > max_content_size)
+        return ERROR_SOCKET_RECEIVE;
+
+    header->flags = buffer[3];
+    header->sequence = get_u32(buffer + 4);
+    header->checksum = (int) get_u32(buffer + 8);
+    header->content_size = get_u32(buffer + 12);
+    header->total_size = get_u64(buffer + 16);
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Send an acknowledgement frame
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param sequence Next expected fragment, all previous ones were received
+ * @param nacks Fragments received corrupt that must be resent
+ * @param nack_count Number of fragments to resend (at most ACK_MAX_NACKS)
+ * @return error_code Error code
+ */
+static error_code send_ack(int sockect_fd, uint32_t sequence, const uint32_t *nacks, size_t nack_count)
+{
+    uint8_t data[ACK_MAX_NACKS * 4];
+
+    for (size_t i = 0; i < nack_count; i++)
+        put_u32(data + i * 4, nacks[i]);
+
+    frame_header header = 
+    {
+        .flags = FRAME_FLAG_ACK,
+        .sequence = sequence,
+        .checksum = generate_checksum(data, nack_count * 4),
+        .content_size = (uint32_t) (nack_count * 4)
+    };
+
+    return write_binary_frame(sockect_fd, &header, (char*) data);
+}
+
+/**
+ * @brief Read an acknowledgement frame
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param sequence Next expected fragment
+ * @param nacks Fragments to resend (ACK_MAX_NACKS entries)
+ * @param nack_count Number of fragments to resend
+ * @return error_code Error code
+ */
+static error_code read_ack(int sockect_fd, uint32_t *sequence, uint32_t *nacks, size_t *nack_count)
+{
+    uint8_t data[ACK_MAX_NACKS * 4];
+    frame_header header;
+    error_code result = read_binary_header(sockect_fd, sizeof(data), &header);
+
+    if (result != SUCCESS)
+        return result;
+
+    if (!(header.flags & FRAME_FLAG_ACK) || header.content_size % 4)
+        return ERROR_SOCKET_RECEIVE;
+
+    if ((result = recv_all(sockect_fd, data, header.content_size)) != SUCCESS)
+        return result;
+
+    if (!validate_checksum(data, header.content_size, header.checksum))
+        return ERROR_SOCKET_RECEIVE;
+
+    *sequence = header.sequence;
+    *nack_count = header.content_size / 4;
+
+    for (size_t i = 0; i < *nack_count; i++)
+        nacks[i] = get_u32(data + i * 4);
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Write a JSON fragment to socket
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param framing How the fragment is delimited
+ * @param payload Encoding of the data of the fragment
+ * @param package Fragment
+ * @return error_code Error code
+ */
+error_code write_fragment(int sockect_fd, framing_mode framing, json_payload payload, fragments* package)
+{
+    char json_package[FRAGMENT_SIZE + JSON_ENCODE_SLACK];
+    uint8_t prefix[4];
+    size_t length = encode_json(package, payload, json_package, sizeof(json_package));
+
+    if (length == 0 || length >= FRAGMENT_SIZE)
+        return ERROR_SOCKET_SEND;
+
+    if (framing == FRAMING_LENGTH)
+    {
+        put_u32(prefix, (uint32_t) length);
+
+        struct iovec iov[2] = 
+        {
+            { .iov_base = prefix, .iov_len = sizeof(prefix) },
+            { .iov_base = json_package, .iov_len = length }
+        };
+
+        return send_all(sockect_fd, iov, 2);
+    }
+
+    memset(json_package + length, 0, FRAGMENT_SIZE - length);
+
+    struct iovec iov = { .iov_base = json_package, .iov_len = FRAGMENT_SIZE };
+
+    return send_all(sockect_fd, &iov, 1);
+}
+
+/**
+ * @brief Read a JSON fragment from socket
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param framing How the fragment is delimited
+ * @param package Fragment read, package->data must hold DATA_FRAGMENT_SIZE bytes
+ * @return error_code Error code
+ */
+error_code read_fragment(int sockect_fd, framing_mode framing, fragments* package)
+{
+    size_t length = FRAGMENT_SIZE;
+    error_code result;
+
+    if (framing == FRAMING_LENGTH)
+    {
+        uint8_t prefix[4];
+
+        if ((result = recv_all(sockect_fd, prefix, sizeof(prefix))) != SUCCESS)
+            return result == ERROR_SOCKET_RECEIVE ? ERROR_SOCKET_DISCONNECT : result;
+
+        // A wrong length leaves the stream out of sync, nothing to resend
+        if ((length = get_u32(prefix)) > FRAGMENT_SIZE)
+            return ERROR_SOCKET_RECEIVE;
+    }
+
+    char* json_package = pool_alloc(POOL_FRAME);
+
+    if (!json_package)
+        return ERROR_SOCKET_RECEIVE;
+
+    if ((result = recv_all(sockect_fd, json_package, length)) != SUCCESS)
+    {
+        pool_free(POOL_FRAME, json_package);
+        return result == ERROR_SOCKET_RECEIVE ? ERROR_SOCKET_DISCONNECT : result;
+    }
+
+    result = decode_json(json_package, length, package);
+
+    pool_free(POOL_FRAME, json_package);
+
+    return result;
+}
+
+/**
+ * @brief Get the size of a binary fragment of a message
+ *
+ * @param data_size Message size
+ * @param fragment_size Data bytes per fragment
+ * @param sequence Fragment sequence
+ * @return size_t Fragment size
+ */
+static size_t binary_fragment_size(uint64_t data_size, uint32_t fragment_size, uint32_t sequence)
+{
+    uint64_t offset = (uint64_t) sequence * fragment_size;
+
+    return data_size - offset > fragment_size ? fragment_size : (size_t) (data_size - offset);
+}
+
+/**
+ * @brief Get the number of binary fragments of a message
+ *
+ * @param data_size Message size
+ * @param fragment_size Data bytes per fragment
+ * @param count Number of fragments
+ * @return int 1 if the message fits in 32 bit sequences, 0 otherwise
+ */
+static int binary_fragment_count(uint64_t data_size, uint32_t fragment_size, uint32_t *count)
+{
+    uint64_t fragments_needed = data_size ? (data_size - 1) / fragment_size + 1 : 1;
+
+    if (fragments_needed > UINT32_MAX || data_size >= SIZE_MAX)
+        return 0;
+
+    *count = (uint32_t) fragments_needed;
+
+    return 1;
+}
+
+/**
+ * @brief Append received bytes to a message buffer
+ *
+ * @param context Message buffer (stream_buffer)
+ * @param data Bytes received
+ * @param size Number of bytes
+ * @return int 0 on success, -1 if memory could not be allocated
+ */
+static int stream_buffer_append(void *context, const char *data, size_t size)
+{
+    stream_buffer* message = (stream_buffer*) context;
+
+    if (message->size + size + 1 > message->capacity)
+    {
+        size_t capacity = message->capacity * 2 > message->size + size + 1 ? message->capacity * 2 : message->size + size + 1;
+        char* grown = realloc(message->data, capacity);
+
+        if (!grown)
+            return -1;
+
+        message->data = grown;
+        message->capacity = capacity;
+    }
+
+    memcpy(message->data + message->size, data, size);
+
+    message->size += size;
+    message->data[message->size] = '\0';
+
+    return 0;
+}
+
+/**
+ * @brief Receive a bulk transfer: map the sealed memory file passed with
+ *        the frame read-only and hand its data to the consumer, or copy it
+ *        into a buffer, without reading it from the socket. The checksum
+ *        runs on each fragment sized piece right before it is used, while
+ *        it is cached. The file cannot change, so a mismatch means a broken
+ *        sender: the transfer is refused (acknowledgement of sequence 0
+ *        without fragments to resend) instead of asked again
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param options Connection options
+ * @param header Bulk frame header already read
+ * @param buffer Data received (only without consumer)
+ * @param bytes_received Bytes received
+ * @param consumer Consumer of received data, NULL to return a buffer
+ * @param context Consumer context
+ * @return error_code Error code
+ */
+static error_code receive_bulk(int sockect_fd, const connection_options *options, const frame_header *header, char **buffer, size_t* bytes_received, stream_consumer consumer, void *context)
+{
+    connection* conn = connection_get(sockect_fd);
+    uint32_t crc = 0xffffffff;
+    struct stat status;
+    char* data = NULL;
+    char* message = NULL;
+    int memory_fd;
+    int seals;
+    error_code result = SUCCESS;
+
+    if (header->flags != (FRAME_FLAG_BULK | FRAME_FLAG_LAST) || header->sequence || header->content_size ||
+        header->total_size == 0 || header->total_size >= SIZE_MAX || !conn || !conn->bulk_fd_count)
+        return ERROR_FRAME_MALFORMED;
+
+    memory_fd = conn->bulk_fds[0];
+    conn->bulk_fd_count--;
+    memmove(conn->bulk_fds, conn->bulk_fds + 1, conn->bulk_fd_count * sizeof(int));
+
+    size_t size = (size_t) header->total_size;
+
+    // Only sealed files are mapped, the sender can no longer change or shrink them under us
+    if ((seals = fcntl(memory_fd, F_GET_SEALS)) < 0 || (seals & BULK_SEALS) != BULK_SEALS || fstat(memory_fd, &status) != 0 ||
+        (uint64_t) status.st_size < header->total_size || (data = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, memory_fd, 0)) == MAP_FAILED)
+    {
+        close(memory_fd);
+        return ERROR_FRAME_MALFORMED;
+    }
+
+    // The mapping keeps the memory alive
+    close(memory_fd);
+
+    if (!consumer && (message = malloc(size + 1)) == NULL)
+        result = ERROR_SOCKET_RECEIVE;
+
+    for (size_t offset = 0; offset < size && result == SUCCESS; offset += options->fragment_size)
+    {
+        size_t count = size - offset < options->fragment_size ? size - offset : options->fragment_size;
+
+        crc = checksum_update(crc, data + offset, count);
+
+        if (message)
+            memcpy(message + offset, data + offset, count);
+        else if (consumer(context, data + offset, count) != 0)
+            result = ERROR_SOCKET_RECEIVE;
+    }
+
+    munmap(data, size);
+
+    if (result == SUCCESS && (int) ~crc != header->checksum)
+    {
+        send_ack(sockect_fd, 0, NULL, 0);
+        result = ERROR_SOCKET_RECEIVE;
+    }
+    else if (result == SUCCESS)
+        result = send_ack(sockect_fd, 1, NULL, 0);
+
+    if (result != SUCCESS)
+    {
+        free(message);
+        return result;
+    }
+
+    if (message)
+    {
+        message[size] = '\0';
+        *buffer = message;
+    }
+
+    if (bytes_received)
+        *bytes_received += size;
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Receive data with a sliding window. Duplicates are dropped, corrupt
+ *        fragments are named in the next acknowledgement so only they are
+ *        resent, and fragments delivered in order are acknowledged
+ *        cumulatively every half window.
+ *
+ *        Without consumer, the first frame sizes the message buffer and
+ *        every fragment is read straight into its place. With a consumer,
+ *        or when the sender streams data of unknown size, fragments wait in
+ *        one window of slots and are passed to the consumer in order.
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param options Connection options
+ * @param buffer Data received (only without consumer)
+ * @param bytes_received Bytes received
+ * @param consumer Consumer of received data, NULL to return a buffer
+ * @param context Consumer context
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+static error_code receive_windowed(int sockect_fd, const connection_options *options, char **buffer, size_t* bytes_received, stream_consumer consumer, void *context, volatile sig_atomic_t *end_flag)
+{
+    uint8_t* received = pool_alloc(POOL_WINDOW);
+    stream_buffer message = { NULL, 0, 0 };
+    char* data = NULL;
+    char* slots = NULL;
+    uint32_t* slot_sizes = NULL;
+    uint32_t nacks[ACK_MAX_NACKS];
+    uint32_t ack_every = options->window / 2 ? options->window / 2 : 1;
+    uint32_t last_sequence = UINT32_MAX;
+    uint32_t expected = 0;
+    uint32_t unacknowledged = 0;
+    uint64_t total_size;
+    size_t nack_count = 0;
+    frame_header header;
+    error_code result;
+
+    if (!received)
+        return ERROR_SOCKET_RECEIVE;
+
+    memset(received, 0, options->window);
+
+    if ((result = wait_readable(sockect_fd, end_flag)) != SUCCESS ||
+        (result = read_binary_header(sockect_fd, options->fragment_size, &header)) != SUCCESS)
+    {
+        pool_free(POOL_WINDOW, received);
+        return result;
+    }
+
+    if (header.flags & FRAME_FLAG_BULK)
+    {
+        pool_free(POOL_WINDOW, received);
+        return receive_bulk(sockect_fd, options, &header, buffer, bytes_received, consumer, context);
+    }
+
+    total_size = header.total_size;
+
+    if (total_size != BINARY_STREAM_SIZE && !binary_fragment_count(total_size, options->fragment_size, &last_sequence))
+        result = ERROR_FRAME_MALFORMED;
+    else if (total_size != BINARY_STREAM_SIZE)
+        last_sequence--;
+
+    // A stream received as a whole message is collected in a growing buffer
+    if (!consumer && total_size == BINARY_STREAM_SIZE)
+    {
+        consumer = stream_buffer_append;
+        context = &message;
+    }
+
+    if (result == SUCCESS && consumer)
+    {
+        slots = malloc((size_t) options->window * options->fragment_size);
+        slot_sizes = malloc((size_t) options->window * sizeof(uint32_t));
+
+        if (!slots || !slot_sizes)
+            result = ERROR_SOCKET_RECEIVE;
+        else if (context == &message && (message.data = calloc(1, sizeof(char))) == NULL)
+            result = ERROR_SOCKET_RECEIVE;
+        else if (context == &message)
+            message.capacity = 1;
+    }
+    else if (result == SUCCESS)
+    {
+        if ((data = malloc((size_t) total_size + 1)) == NULL)
+            result = ERROR_SOCKET_RECEIVE;
+        else
+            data[total_size] = '\0';
+    }
+
+    while (result == SUCCESS && (last_sequence == UINT32_MAX || expected <= last_sequence))
+    {
+        uint32_t slot = header.sequence % options->window;
+
+        if (header.flags & (FRAME_FLAG_ACK | FRAME_FLAG_CHANNEL))
+        {
+            result = ERROR_SOCKET_RECEIVE;
+            break;
+        }
+
+        if (header.total_size != total_size || header.sequence > last_sequence ||
+            (header.sequence >= expected && header.sequence - expected >= options->window))
+        {
+            result = ERROR_FRAME_MALFORMED;
+            break;
+        }
+
+        if (total_size != BINARY_STREAM_SIZE && (header.content_size != binary_fragment_size(total_size, options->fragment_size, header.sequence) ||
+            ((header.flags & FRAME_FLAG_LAST) != 0) != (header.sequence == last_sequence)))
+        {
+            result = ERROR_FRAME_MALFORMED;
+            break;
+        }
+
+        // Already delivered or already waiting to be delivered
+        if (header.sequence < expected || received[slot])
+        {
+            if ((result = recv_discard(sockect_fd, header.content_size)) != SUCCESS)
+                break;
+        }
+        else
+        {
+            char* destination = slots ? slots + (size_t) slot * options->fragment_size : data + (size_t) header.sequence * options->fragment_size;
+
+            if ((result = recv_all(sockect_fd, destination, header.content_size)) != SUCCESS)
+                break;
+
+            if (!validate_checksum(destination, header.content_size, header.checksum))
+                nacks[nack_count++] = header.sequence;
+            else
+            {
+                received[slot] = 1;
+
+                if (slot_sizes)
+                    slot_sizes[slot] = header.content_size;
+
+                if (header.flags & FRAME_FLAG_LAST)
+                    last_sequence = header.sequence;
+            }
+
+            while (expected <= last_sequence && received[expected % options->window])
+            {
+                size_t size;
+
+                slot = expected % options->window;
+                received[slot] = 0;
+
+                if (slots)
+                {
+                    size = slot_sizes[slot];
+
+                    if (consumer(context, slots + (size_t) slot * options->fragment_size, size) != 0)
+                    {
+                        result = ERROR_SOCKET_RECEIVE;
+                        break;
+                    }
+                }
+                else
+                    size = binary_fragment_size(total_size, options->fragment_size, expected);
+
+                if(bytes_received)
+                    *bytes_received += size;
+
+                expected++;
+                unacknowledged++;
+            }
+
+            if (result != SUCCESS)
+                break;
+
+            if (nack_count || unacknowledged >= ack_every || (last_sequence != UINT32_MAX && expected > last_sequence))
+            {
+                if ((result = send_ack(sockect_fd, expected, nacks, nack_count)) != SUCCESS)
+                    break;
+
+                nack_count = 0;
+                unacknowledged = 0;
+            }
+        }
+
+        if (last_sequence != UINT32_MAX && expected > last_sequence)
+            break;
+
+        if ((result = wait_readable(sockect_fd, end_flag)) != SUCCESS ||
+            (result = read_binary_header(sockect_fd, options->fragment_size, &header)) != SUCCESS)
+            break;
+    }
+
+    pool_free(POOL_WINDOW, received);
+    free(slots);
+    free(slot_sizes);
+
+    if (result != SUCCESS)
+    {
+        free(data);
+        free(message.data);
+        return result;
+    }
+
+    if (buffer)
+        *buffer = context == &message ? message.data : data;
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Prepare a frame sent with a sliding window
+ *
+ * @param data Message
+ * @param data_size Message size
+ * @param slots Fragments produced when streaming, NULL to send the message
+ * @param slot_sizes Sizes of fragments produced when streaming
+ * @param options Connection options
+ * @param sequence Fragment sequence
+ * @param last_sequence Sequence of the last fragment
+ * @param header Frame header
+ * @return const char* Frame data
+ */
+static const char* windowed_frame(const char *data, size_t data_size, const char *slots, const uint32_t *slot_sizes, const connection_options *options, uint32_t sequence, uint32_t last_sequence, frame_header *header)
+{
+    const char* content;
+
+    if (!slots)
+    {
+        content = data + (size_t) sequence * options->fragment_size;
+        header->content_size = (uint32_t) binary_fragment_size(data_size, options->fragment_size, sequence);
+        header->total_size = data_size;
+    }
+    else
+    {
+        content = slots + (size_t) (sequence % options->window) * options->fragment_size;
+        header->content_size = slot_sizes[sequence % options->window];
+        header->total_size = BINARY_STREAM_SIZE;
+    }
+
+    header->flags = sequence == last_sequence ? FRAME_FLAG_LAST : 0;
+    header->sequence = sequence;
+    header->checksum = generate_checksum((void*) content, header->content_size);
+
+    return content;
+}
+
+/**
+ * @brief Send data with a sliding window of fragments in flight, resending
+ *        only the fragments named by acknowledgements. A message is sent
+ *        straight from its buffer behind each header; a stream is produced
+ *        into one window of slots, kept until acknowledged
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param options Connection options
+ * @param data Data to send
+ * @param data_size Data size
+ * @param producer Producer of data to stream, NULL to send data
+ * @param context Producer context
+ * @param bytes_sent Bytes sent
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+static error_code send_windowed(int sockect_fd, const connection_options *options, char *data, size_t data_size, stream_producer producer, void *context, size_t *bytes_sent, volatile sig_atomic_t *end_flag)
+{
+    uint32_t nacks[ACK_MAX_NACKS];
+    uint32_t last_sequence = UINT32_MAX;
+    uint32_t base = 0;
+    uint32_t next_sequence = 0;
+    uint32_t acknowledged;
+    size_t nack_count;
+    char* slots = NULL;
+    uint32_t* slot_sizes = NULL;
+    int producer_failed = 0;
+    frame_header header;
+    const char* content;
+    error_code result = SUCCESS;
+
+    if (!producer)
+    {
+        if (!binary_fragment_count(data_size, options->fragment_size, &last_sequence))
+            return ERROR_SOCKET_SEND;
+
+        last_sequence--;
+    }
+    else
+    {
+        slots = malloc((size_t) options->window * options->fragment_size);
+        slot_sizes = malloc((size_t) options->window * sizeof(uint32_t));
+
+        if (!slots || !slot_sizes)
+            result = ERROR_SOCKET_SEND;
+    }
+
+    while (result == SUCCESS && (last_sequence == UINT32_MAX || base <= last_sequence))
+    {
+        while ((last_sequence == UINT32_MAX || next_sequence <= last_sequence) && next_sequence - base < options->window)
+        {
+            if(end_flag && *end_flag)
+            {
+                result = END_SIGNAL;
+                break;
+            }
+
+            if (producer)
+            {
+                // The producer may block, what is produced already goes out first
+                if ((result = send_flush(sockect_fd)) != SUCCESS)
+                    break;
+
+                ssize_t produced = producer_failed ? 0 : producer(context, slots + (size_t) (next_sequence % options->window) * options->fragment_size, options->fragment_size);
+
+                if (produced < 0)
+                {
+                    producer_failed = 1;
+                    produced = 0;
+                }
+
+                slot_sizes[next_sequence % options->window] = (uint32_t) produced;
+
+                // The stream ends with an empty fragment
+                if (produced == 0)
+                    last_sequence = next_sequence;
+            }
+
+            content = windowed_frame(data, data_size, slots, slot_sizes, options, next_sequence, last_sequence, &header);
+
+            if ((result = queue_binary_frame(sockect_fd, &header, content)) != SUCCESS)
+                break;
+
+            if (bytes_sent)
+                *bytes_sent += header.content_size;
+
+            next_sequence++;
+        }
+
+        if (result != SUCCESS || (result = send_flush(sockect_fd)) != SUCCESS || (result = wait_readable(sockect_fd, end_flag)) != SUCCESS ||
+            (result = read_ack(sockect_fd, &acknowledged, nacks, &nack_count)) != SUCCESS)
+            break;
+
+        if (acknowledged > next_sequence)
+        {
+            result = ERROR_SOCKET_RECEIVE;
+            break;
+        }
+
+        if (acknowledged > base)
+            base = acknowledged;
+
+        for (size_t i = 0; i < nack_count && result == SUCCESS; i++)
+        {
+            if (nacks[i] < base || nacks[i] >= next_sequence)
+                continue;
+
+            content = windowed_frame(data, data_size, slots, slot_sizes, options, nacks[i], last_sequence, &header);
+
+            result = queue_binary_frame(sockect_fd, &header, content);
+        }
+    }
+
+    // The kernel may still be sending from the slots
+    error_code flushed = send_flush(sockect_fd);
+
+    if (result == SUCCESS)
+        result = flushed;
+
+    free(slots);
+    free(slot_sizes);
+
+    if (result == SUCCESS && producer_failed)
+        return ERROR_SOCKET_SEND;
+
+    return result;
+}
+
+/**
+ * @brief Append data to the memory file of a bulk transfer, adding it to
+ *        the checksum of the transfer on the way
+ *
+ * @param memory_fd Memory file, created on the first call if -1
+ * @param crc CRC state of the data appended so far
+ * @param data Data to append
+ * @param size Data size
+ * @return int 0 if success, -1 if error
+ */
+static int bulk_append(int *memory_fd, uint32_t *crc, const char *data, size_t size)
+{
+    if (*memory_fd < 0 && (*memory_fd = memfd_create("ipc-bulk", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+        return -1;
+
+    while (size > 0)
+    {
+        size_t count = size < BULK_CHUNK ? size : BULK_CHUNK;
+
+        *crc = checksum_update(*crc, data, count);
+
+        for (size_t done = 0; done < count; )
+        {
+            ssize_t written = write(*memory_fd, data + done, count - done);
+
+            if (written < 0 && errno == EINTR)
+                continue;
+
+            if (written <= 0)
+                return -1;
+
+            done += (size_t) written;
+        }
+
+        data += count;
+        size -= count;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write a bulk frame, passing the memory file along with the header
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param header Frame header
+ * @param memory_fd Memory file holding the data
+ * @return error_code Error code
+ */
+static error_code write_bulk_frame(int sockect_fd, const frame_header *header, int memory_fd)
+{
+    uint8_t buffer[BINARY_HEADER_SIZE];
+    char control[CMSG_SPACE(sizeof(int))];
+    ssize_t sent;
+
+    encode_binary_header(header, buffer);
+
+    struct iovec iov = { .iov_base = buffer, .iov_len = BINARY_HEADER_SIZE };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+
+    memset(control, 0, sizeof(control));
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+
+    memcpy(CMSG_DATA(cmsg), &memory_fd, sizeof(int));
+
+    while ((sent = sendmsg(sockect_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+
+    if (sent < 0)
+        return errno == EPIPE || errno == ECONNRESET ? ERROR_SOCKET_DISCONNECT : ERROR_SOCKET_SEND;
+
+    // The file travels with the first byte, the rest of the header follows alone
+    iov.iov_base = buffer + sent;
+    iov.iov_len = BINARY_HEADER_SIZE - (size_t) sent;
+
+    return iov.iov_len ? send_all(sockect_fd, &iov, 1) : SUCCESS;
+}
+
+/**
+ * @brief Seal the memory file of a bulk transfer and pass it to the peer
+ *        behind one frame carrying the size and checksum of the whole
+ *        data, then wait for the acknowledgement
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param memory_fd Memory file holding the data (closed by the caller)
+ * @param size Data size
+ * @param checksum Checksum of the data
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+static error_code send_bulk(int sockect_fd, int memory_fd, uint64_t size, int checksum, volatile sig_atomic_t *end_flag)
+{
+    uint32_t nacks[ACK_MAX_NACKS];
+    uint32_t acknowledged;
+    size_t nack_count;
+    error_code result;
+
+    frame_header header = 
+    {
+        .flags = FRAME_FLAG_BULK | FRAME_FLAG_LAST,
+        .sequence = 0,
+        .checksum = checksum,
+        .content_size = 0,
+        .total_size = size
+    };
+
+    if (fcntl(memory_fd, F_ADD_SEALS, BULK_SEALS) != 0)
+        return ERROR_SOCKET_SEND;
+
+    if ((result = write_bulk_frame(sockect_fd, &header, memory_fd)) != SUCCESS || (result = wait_readable(sockect_fd, end_flag)) != SUCCESS ||
+        (result = read_ack(sockect_fd, &acknowledged, nacks, &nack_count)) != SUCCESS)
+        return result;
+
+    // The receiver refuses data that does not match the checksum
+    return acknowledged == 1 ? SUCCESS : ERROR_SOCKET_SEND;
+}
+
+/**
+ * @brief Send a message as a bulk transfer
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param data Data to send
+ * @param data_size Data size
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+static error_code send_bulk_message(int sockect_fd, const char *data, size_t data_size, volatile sig_atomic_t *end_flag)
+{
+    uint32_t crc = 0xffffffff;
+    int memory_fd = -1;
+    error_code result = ERROR_SOCKET_SEND;
+
+    if (bulk_append(&memory_fd, &crc, data, data_size) == 0)
+        result = send_bulk(sockect_fd, memory_fd, data_size, (int) ~crc, end_flag);
+
+    if (memory_fd >= 0)
+        close(memory_fd);
+
+    return result;
+}
+
+/**
+ * @brief Answer a JSON fragment, asking for it again or not
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param resend 1 to ask for the fragment again
+ */
+static void send_resend(int sockect_fd, int resend)
+{
+    struct iovec iov = { .iov_base = &resend, .iov_len = sizeof(int) };
+
+    send_all(sockect_fd, &iov, 1);
+}
+
+/**
+ * @brief Receive data with the legacy stop-and-wait protocol. Without
+ *        consumer, fragments are decoded straight after the previous ones
+ *        in a buffer grown to the total size announced by the first one
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param buffer Data received (only without consumer)
+ * @param bytes_received Bytes received
+ * @param consumer Consumer of received data, NULL to return a buffer
+ * @param context Consumer context
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+static error_code receive_json(int sockect_fd, const connection_options *options, char **buffer, size_t* bytes_received, stream_consumer consumer, void *context, volatile sig_atomic_t *end_flag)
+{
+    fragments current;
+    error_code result;
+    char* data = NULL;
+    size_t capacity = 0;
+    size_t offset = 0;
+
+    if (consumer && (data = pool_alloc(POOL_FRAME)) == NULL)
+        return ERROR_SOCKET_RECEIVE;
+
+    while (1)
+    {
+        if (!consumer && capacity < offset + DATA_FRAGMENT_SIZE + 1)
+        {
+            size_t needed = capacity * 2 > offset + DATA_FRAGMENT_SIZE + 1 ? capacity * 2 : offset + DATA_FRAGMENT_SIZE + 1;
+            char* grown = realloc(data, needed);
+
+            if (!grown)
+            {
+                free(data);
+                return ERROR_SOCKET_RECEIVE;
+            }
+
+            data = grown;
+            capacity = needed;
+        }
+
+        if ((result = wait_readable(sockect_fd, end_flag)) != SUCCESS)
+            break;
+
+        current.data = data + offset;
+
+        result = read_fragment(sockect_fd, options->framing, &current);
+
+        if (result == ERROR_FRAME_MALFORMED)
+        {
+            send_resend(sockect_fd, 1);
+
+            continue;
+        }
+
+        if (result != SUCCESS)
+            break;
+
+        if(!validate_checksum(current.data, current.content_size, current.checksum))
+        {
+            send_resend(sockect_fd, 1);
+
+            continue;
+        }
+
+        send_resend(sockect_fd, 0);
+
+        if(bytes_received)
+            *bytes_received += current.content_size;
+
+        if (!consumer)
+            offset += current.content_size;
+        else if (consumer(context, current.data, current.content_size) != 0)
+        {
+            result = ERROR_SOCKET_RECEIVE;
+            break;
+        }
+
+        if(current.last)
+            break;
+
+        if (!consumer && offset == current.content_size && current.total_size < SIZE_MAX && current.total_size + 1 > capacity)
+        {
+            char* grown = realloc(data, current.total_size + 1);
+
+            if (grown)
+            {
+                data = grown;
+                capacity = current.total_size + 1;
+            }
+        }
+    }
+
+    if (consumer)
+    {
+        pool_free(POOL_FRAME, data);
+        return result;
+    }
+
+    if (result != SUCCESS)
+    {
+        free(data);
+        return result;
+    }
+
+    data[offset] = '\0';
+
+    *buffer = data;
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Send fragments with the legacy stop-and-wait protocol
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param first First fragment
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+static error_code send_json(int sockect_fd, const connection_options *options, fragments *first, volatile sig_atomic_t *end_flag)
+{
+    fragments* current = first;
+    int resend;
+    int retries;
+
+    while(current)
+    {
+        retries = 0;
+
+        do
+        {
+            if(end_flag && *end_flag)
+                return END_SIGNAL;
+
+            if (write_fragment(sockect_fd, options->framing, options->payload, current) != SUCCESS) 
+            {
+                if(retries > 3)
+                    return ERROR_SOCKET_SEND;
+                else
+                    retries++;
+
+                resend = 1;
+                continue;
+            }
+
+            if (recv_all(sockect_fd, &resend, sizeof(int)) != SUCCESS)
+                return ERROR_SOCKET_DISCONNECT;
+        } while (resend);
+        
+        current = current->next;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Stream data with the legacy stop-and-wait protocol, every chunk
+ *        produced is sent as JSON fragments and an empty last fragment ends
+ *        the stream
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param producer Producer of data to send
+ * @param context Producer context
+ * @param bytes_sent Bytes sent
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+static error_code send_json_stream(int sockect_fd, const connection_options *options, stream_producer producer, void *context, size_t *bytes_sent, volatile sig_atomic_t *end_flag)
+{
+    char* chunk = pool_alloc(POOL_FRAME);
+    int producer_failed = 0;
+    error_code result = SUCCESS;
+
+    if (!chunk)
+        return ERROR_SOCKET_SEND;
+
+    while (result == SUCCESS)
+    {
+        ssize_t produced = producer_failed ? 0 : producer(context, chunk, DATA_FRAGMENT_SIZE);
+
+        if (produced < 0)
+        {
+            producer_failed = 1;
+            produced = 0;
+        }
+
+        fragments* first = fragment(chunk, (size_t) produced, DATA_FRAGMENT_SIZE, options->payload);
+
+        for (fragments* current = first; current; current = current->next)
+            current->last = produced == 0;
+
+        result = send_json(sockect_fd, options, first, end_flag);
+
+        free_package_list(first);
+
+        if (result == SUCCESS && bytes_sent)
+            *bytes_sent += (size_t) produced;
+
+        if (produced == 0)
+            break;
+    }
+
+    pool_free(POOL_FRAME, chunk);
+
+    if (result == SUCCESS && producer_failed)
+        return ERROR_SOCKET_SEND;
+
+    return result;
+}
+
+/**
+ * @brief Produce the next compressed bytes of a message or stream (stream
+ *        producer). The compression stream is flushed at the end of the
+ *        data, so the receiver can decompress the whole message while the
+ *        dictionary is kept for the next one
+ *
+ * @param context Compressed data (compress_source)
+ * @param buffer Output buffer
+ * @param size Output buffer size
+ * @return ssize_t Bytes produced, 0 at the end, -1 if error
+ */
+static ssize_t compress_produce(void *context, char *buffer, size_t size)
+{
+    compress_source* source = (compress_source*) context;
+    z_stream* stream = source->deflater;
+
+    if (source->flushed)
+        return 0;
+
+    stream->next_out = (Bytef*) buffer;
+    stream->avail_out = (uInt) size;
+
+    // A message fills whole fragments, a stream sends what is ready
+    while (stream->avail_out > 0 && (!source->producer || stream->avail_out == size))
+    {
+        if (stream->avail_in == 0 && !source->input_done)
+        {
+            size_t length;
+
+            if (source->producer)
+            {
+                ssize_t produced = source->producer(source->context, source->input, CONNECTION_COMPRESSION_CHUNK);
+
+                if (produced < 0)
+                    return -1;
+
+                length = (size_t) produced;
+                stream->next_in = (Bytef*) source->input;
+            }
+            else
+            {
+                length = source->data_size - source->bytes < CONNECTION_COMPRESSION_CHUNK ? source->data_size - source->bytes : CONNECTION_COMPRESSION_CHUNK;
+                stream->next_in = (Bytef*) source->data + source->bytes;
+            }
+
+            stream->avail_in = (uInt) length;
+            source->bytes += length;
+            source->input_done = length == 0 || (!source->producer && source->bytes == source->data_size);
+        }
+
+        int flush = source->input_done && stream->avail_in == 0 ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        int status = deflate(stream, flush);
+
+        if (status != Z_OK && status != Z_BUF_ERROR)
+            return -1;
+
+        if (flush == Z_SYNC_FLUSH && (stream->avail_out > 0 || status == Z_BUF_ERROR))
+        {
+            source->flushed = 1;
+            break;
+        }
+    }
+
+    return (ssize_t) (size - stream->avail_out);
+}
+
+/**
+ * @brief Decompress received bytes and pass them on (stream consumer)
+ *
+ * @param context Decompressed data (decompress_sink)
+ * @param data Compressed bytes
+ * @param size Number of bytes
+ * @return int 0 to continue, -1 if the data is corrupt or the consumer aborts
+ */
+static int decompress_consume(void *context, const char *data, size_t size)
+{
+    decompress_sink* sink = (decompress_sink*) context;
+    z_stream* stream = sink->inflater;
+
+    stream->next_in = (Bytef*) data;
+    stream->avail_in = (uInt) size;
+
+    do
+    {
+        stream->next_out = (Bytef*) sink->output;
+        stream->avail_out = CONNECTION_COMPRESSION_CHUNK;
+
+        int status = inflate(stream, Z_SYNC_FLUSH);
+
+        if (status != Z_OK && status != Z_BUF_ERROR)
+            return -1;
+
+        size_t produced = CONNECTION_COMPRESSION_CHUNK - stream->avail_out;
+
+        if (produced && sink->consumer(sink->context, sink->output, produced) != 0)
+            return -1;
+
+        sink->bytes += produced;
+    } while (stream->avail_in > 0 || stream->avail_out == 0);
+
+    return 0;
+}
+
+/**
+ * @brief Send a message or stream through the compression stream of the
+ *        connection. Compressed data is always streamed, since its size is
+ *        not known until it is produced. The stream is shared with request
+ *        channels, so channel fragments wait until the whole message is sent
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param conn Connection state
+ * @param data Data to send, NULL to stream
+ * @param data_size Data size
+ * @param producer Producer of data to stream
+ * @param context Producer context
+ * @param bytes_sent Uncompressed bytes sent
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+static error_code send_compressed(int sockect_fd, connection *conn, const char *data, size_t data_size, stream_producer producer, void *context, size_t *bytes_sent, volatile sig_atomic_t *end_flag)
+{
+    compress_source source = { &conn->deflater, data, data_size, producer, context, NULL, 0, 0, 0 };
+    error_code result;
+
+    if (producer && (source.input = malloc(CONNECTION_COMPRESSION_CHUNK)) == NULL)
+        return ERROR_SOCKET_SEND;
+
+    // Deflate calls must not interleave with those of channel fragments
+    pthread_mutex_lock(&conn->write_mutex);
+
+    if (conn->options.format == WIRE_FORMAT_BINARY)
+        result = send_windowed(sockect_fd, &conn->options, NULL, 0, compress_produce, &source, NULL, end_flag);
+    else
+        result = send_json_stream(sockect_fd, &conn->options, compress_produce, &source, NULL, end_flag);
+
+    pthread_mutex_unlock(&conn->write_mutex);
+
+    free(source.input);
+
+    if (bytes_sent)
+        *bytes_sent = source.bytes;
+
+    return result;
+}
+
+/**
+ * @brief Receive a message or stream through the decompression stream of
+ *        the connection
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param conn Connection state
+ * @param buffer Data received (only without consumer)
+ * @param bytes_received Uncompressed bytes received
+ * @param consumer Consumer of received data, NULL to return a buffer
+ * @param context Consumer context
+ * @param end_flag End test flag
+ * @return error_code Error code
+ */
+static error_code receive_compressed(int sockect_fd, connection *conn, char **buffer, size_t* bytes_received, stream_consumer consumer, void *context, volatile sig_atomic_t *end_flag)
+{
+    stream_buffer message = { NULL, 0, 0 };
+    decompress_sink sink = { &conn->inflater, consumer, context, NULL, 0 };
+    error_code result;
+
+    if (!consumer)
+    {
+        if ((message.data = calloc(1, sizeof(char))) == NULL)
+            return ERROR_SOCKET_RECEIVE;
+
+        message.capacity = 1;
+        sink.consumer = stream_buffer_append;
+        sink.context = &message;
+    }
+
+    if ((sink.output = malloc(CONNECTION_COMPRESSION_CHUNK)) == NULL)
+    {
+        free(message.data);
+        return ERROR_SOCKET_RECEIVE;
+    }
+
+    if (conn->options.format == WIRE_FORMAT_BINARY)
+        result = receive_windowed(sockect_fd, &conn->options, NULL, NULL, decompress_consume, &sink, end_flag);
+    else
+        result = receive_json(sockect_fd, &conn->options, NULL, NULL, decompress_consume, &sink, end_flag);
+
+    free(sink.output);
+
+    if (bytes_received)
+        *bytes_received = sink.bytes;
+
+    if (result != SUCCESS)
+    {
+        free(message.data);
+        return result;
+    }
+
+    if (!consumer)
+        *buffer = message.data;
+
+    return SUCCESS;
+}
+
+error_code receive_data(int sockect_fd, char **buffer, size_t* bytes_received, volatile sig_atomic_t *end_flag)
+{
+    connection* conn = connection_get(sockect_fd);
+    connection_options options;
+
+    connection_get_options(sockect_fd, &options);
+
+    if(bytes_received)
+        *bytes_received = 0;
+
+    if (conn && conn->compressed)
+        return receive_compressed(sockect_fd, conn, buffer, bytes_received, NULL, NULL, end_flag);
+
+    if (options.format == WIRE_FORMAT_BINARY)
+        return receive_windowed(sockect_fd, &options, buffer, bytes_received, NULL, NULL, end_flag);
+
+    return receive_json(sockect_fd, &options, buffer, bytes_received, NULL, NULL, end_flag);
+}
+
+error_code send_data(int sockect_fd, char *data, size_t data_size, volatile sig_atomic_t *end_flag) 
+{
+    connection* conn = connection_get(sockect_fd);
+    connection_options options;
+
+    connection_get_options(sockect_fd, &options);
+
+    if (conn && conn->compressed)
+        return send_compressed(sockect_fd, conn, data, data_size, NULL, NULL, NULL, end_flag);
+
+    if (options.format == WIRE_FORMAT_BINARY && options.bulk && data_size >= options.bulk)
+        return send_bulk_message(sockect_fd, data, data_size, end_flag);
+
+    if (options.format == WIRE_FORMAT_BINARY)
+        return send_windowed(sockect_fd, &options, data, data_size, NULL, NULL, NULL, end_flag);
+
+    fragments* first = fragment(data, data_size, DATA_FRAGMENT_SIZE, options.payload);
+    error_code result = send_json(sockect_fd, &options, first, end_flag);
+
+    free_package_list(first);
+
+    return result;
+}
+
+error_code receive_stream(int sockect_fd, stream_consumer consumer, void *context, size_t* bytes_received, volatile sig_atomic_t *end_flag)
+{
+    connection* conn = connection_get(sockect_fd);
+    connection_options options;
+
+    connection_get_options(sockect_fd, &options);
+
+    if(bytes_received)
+        *bytes_received = 0;
+
+    if (conn && conn->compressed)
+        return receive_compressed(sockect_fd, conn, NULL, bytes_received, consumer, context, end_flag);
+
+    if (options.format == WIRE_FORMAT_BINARY)
+        return receive_windowed(sockect_fd, &options, NULL, bytes_received, consumer, context, end_flag);
+
+    return receive_json(sockect_fd, &options, NULL, bytes_received, consumer, context, end_flag);
+}
+
+error_code send_stream(int sockect_fd, stream_producer producer, void *context, size_t* bytes_sent, volatile sig_atomic_t *end_flag)
+{
+    connection* conn = connection_get(sockect_fd);
+    connection_options options;
+
+    connection_get_options(sockect_fd, &options);
+
+    if(bytes_sent)
+        *bytes_sent = 0;
+
+    if (conn && conn->compressed)
+        return send_compressed(sockect_fd, conn, NULL, 0, producer, context, bytes_sent, end_flag);
+
+    if (options.format == WIRE_FORMAT_BINARY)
+        return send_windowed(sockect_fd, &options, NULL, 0, producer, context, bytes_sent, end_flag);
+
+    return send_json_stream(sockect_fd, &options, producer, context, bytes_sent, end_flag);
+}
+
+uint32_t channel_count(int sockect_fd)
+{
+    connection* conn = connection_get(sockect_fd);
+
+    return conn && conn->options.format == WIRE_FORMAT_BINARY ? conn->options.channels : 0;
+}
+
+/**
+ * @brief Write one frame of a request channel
+ *
+ * @param sockect_fd Socket file descriptor
+ * @param channel Channel
+ * @param data Frame data
+ * @param size Frame data size
+ * @param last 1 if the frame ends the message
+ * @return error_code Error code
+ */
+static error_code channel_write_frame(int sockect_fd, uint32_t channel, const char *data, size_t size, int last)
+{
+    frame_header header = 
+    {
+        .flags = (uint8_t) (FRAME_FLAG_CHANNEL | (last ? FRAME_FLAG_LAST : 0)),
+        .sequence = channel,
+        .checksum = generate_checksum((void*) data, size),
+        .content_size = (uint32_t) size,
+        .total_size = BINARY_STREAM_SIZE
+    };
+
+    return write_binary_frame(sockect_fd, &header, data);
+}
+
+/**
+ * @brief Write one fragment of a request channel. On compressed
+ *        connections it is compressed and flushed in the shared stream,
+ *        which may take more than one frame
+ *
+ * @param conn Connection state
+ * @param sockect_fd Socket file descriptor
+ * @param channel Channel
+ * @param data Fragment data
+ * @param size Fragment size
+ * @param last 1 if the fragment ends the message
+ * @return error_code Error code
+ */
+static error_code channel_write_fragment(connection *conn, int sockect_fd, uint32_t channel, const char *data, size_t size, int last)
+{
+    error_code result = SUCCESS;
+    int done;
+
+    // One fragment at a time, fragments of other channels go in between
+    pthread_mutex_lock(&conn->write_mutex);
+
+    if (!conn->compressed)
+        result = channel_write_frame(sockect_fd, channel, data, size, last);
+    else
+    {
+        conn->deflater.next_in = (Bytef*) data;
+        conn->deflater.avail_in = (uInt) size;
+
+        do
+        {
+            conn->deflater.next_out = (Bytef*) conn->channel_output;
+            conn->deflater.avail_out = conn->options.fragment_size;
+
+            int status = deflate(&conn->deflater, Z_SYNC_FLUSH);
+
+            if (status != Z_OK && status != Z_BUF_ERROR)
+            {
+                result = ERROR_SOCKET_SEND;
+                break;
+            }
+
+            // The flush is complete once it leaves room in the output
+            done = conn->deflater.avail_out > 0;
+
+            result = channel_write_frame(sockect_fd, channel, conn->channel_output, conn->options.fragment_size - conn->deflater.avail_out, last && done);
+        } while (result == SUCCESS && !done);
+    }
+
+    pthread_mutex_unlock(&conn->write_mutex);
+
+    return result;
+}
+
+error_code channel_send(int sockect_fd, uint32_t channel, const char *data, size_t data_size, volatile sig_atomic_t *end_flag)
+{
+    connection* conn = connection_get(sockect_fd);
+    size_t offset = 0;
+
+    if (channel >= channel_count(sockect_fd))
+        return ERROR_SOCKET_SEND;
+
+    do
+    {
+        size_t size = binary_fragment_size(data_size, conn->options.fragment_size, (uint32_t) (offset / conn->options.fragment_size));
+        error_code result;
+
+        if(end_flag && *end_flag)
+            return END_SIGNAL;
+
+        if ((result = channel_write_fragment(conn, sockect_fd, channel, data + offset, size, offset + size == data_size)) != SUCCESS)
+            return result;
+
+        offset += size;
+    } while (offset < data_size);
+
+    return SUCCESS;
+}
+
+error_code channel_send_stream(int sockect_fd, uint32_t channel, stream_producer producer, void *context, size_t *bytes_sent, volatile sig_atomic_t *end_flag)
+{
+    connection* conn = connection_get(sockect_fd);
+    error_code result = SUCCESS;
+    ssize_t produced;
+    char* chunk;
+
+    if(bytes_sent)
+        *bytes_sent = 0;
+
+    if (channel >= channel_count(sockect_fd))
+        return ERROR_SOCKET_SEND;
+
+    if ((chunk = malloc(conn->options.fragment_size)) == NULL)
+        return ERROR_SOCKET_SEND;
+
+    do
+    {
+        if(end_flag && *end_flag)
+        {
+            result = END_SIGNAL;
+            break;
+        }
+
+        // The message ends with an empty fragment, also when the producer fails
+        if ((produced = producer(context, chunk, conn->options.fragment_size)) < 0)
+            result = ERROR_SOCKET_SEND;
+
+        size_t size = produced > 0 ? (size_t) produced : 0;
+        error_code written = channel_write_fragment(conn, sockect_fd, channel, chunk, size, size == 0);
+
+        if (written != SUCCESS)
+        {
+            result = written;
+            break;
+        }
+
+        if (bytes_sent)
+            *bytes_sent += size;
+    } while (produced > 0);
+
+    free(chunk);
+
+    return result;
+}
+
+error_code channel_receive(int sockect_fd, uint32_t *channel, char **data, size_t *data_size, int *last, volatile sig_atomic_t *end_flag)
+{
+    connection* conn = connection_get(sockect_fd);
+    frame_header header;
+    error_code result;
+    char* content;
+
+    if (!conn || channel_count(sockect_fd) == 0)
+        return ERROR_SOCKET_RECEIVE;
+
+    if ((result = wait_readable(sockect_fd, end_flag)) != SUCCESS ||
+        (result = read_binary_header(sockect_fd, conn->options.fragment_size, &header)) != SUCCESS)
+        return result;
+
+    if (!(header.flags & FRAME_FLAG_CHANNEL) || header.sequence >= conn->options.channels)
+        return ERROR_FRAME_MALFORMED;
+
+    if ((content = malloc(header.content_size + 1)) == NULL)
+        return ERROR_SOCKET_RECEIVE;
+
+    // Channels are not acknowledged, a corrupt fragment cannot be resent
+    if ((result = recv_all(sockect_fd, content, header.content_size)) == SUCCESS && !validate_checksum(content, header.content_size, header.checksum))
+        result = ERROR_FRAME_MALFORMED;
+
+    if (result != SUCCESS)
+    {
+        free(content);
+        return result;
+    }
+
+    content[header.content_size] = '\0';
+
+    if (conn->compressed)
+    {
+        stream_buffer message = { NULL, 0, 0 };
+        decompress_sink sink = { &conn->inflater, stream_buffer_append, &message, NULL, 0 };
+
+        if ((message.data = calloc(1, sizeof(char))) != NULL)
+            message.capacity = 1;
+
+        if (!message.data || (sink.output = malloc(CONNECTION_COMPRESSION_CHUNK)) == NULL || decompress_consume(&sink, content, header.content_size) != 0)
+            result = ERROR_SOCKET_RECEIVE;
+
+        free(sink.output);
+        free(content);
+
+        if (result != SUCCESS)
+        {
+            free(message.data);
+            return result;
+        }
+
+        content = message.data;
+        header.content_size = (uint32_t) message.size;
+    }
+
+    *channel = header.sequence;
+    *data = content;
+    *data_size = header.content_size;
+    *last = (header.flags & FRAME_FLAG_LAST) != 0;
+
+    return SUCCESS;
+}
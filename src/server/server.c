@@ -1,19 +1,31 @@
+// accept4
+#define _GNU_SOURCE
+
 #include "server.h"
 
 const char* client_type_to_string[] = {"A", "B", "C"};
 
 volatile sig_atomic_t finished = 0;
 
-// Mutex for concurrent access to handle thread list
+// Mutex for session and command threads starting and ending while the server ends
 pthread_mutex_t mutex;
 
+// Signaled when the last command thread ends
+pthread_cond_t commands_done;
+
+// Event loop marker of the wakeup descriptor
+static int wakeup_source;
+
 void signal_handler(int sig, siginfo_t *info, void* context)
 {
     UNUSED(info);
     UNUSED(context);
 
     if(sig == SIGTERM || sig == SIGINT || sig == SIGHUP || sig == SIGPIPE)
+    {
         finished = 1;
+        communication_wakeup();
+    }
 }
 
 void signal_handler_init(void)
@@ -31,143 +43,519 @@ void signal_handler_init(void)
     sigaction(SIGPIPE, &sa, NULL);
 }
 
-void client_a_handle(int client_fd)
+void journalctl_send(int client_fd, int channel, client_type type, const char* command, int compress, int handler)
 {
-    char* data = NULL;
-    char* result = NULL;
+    journalctl_stream stream;
+    size_t bytes_sent;
+    error_code out;
 
-    while (1)
+    if (journalctl_open(&stream, command, compress, client_fd, &finished) != 0)
     {
-        size_t bytes_received;
-        size_t bytes_sent;
+        char result[128];
 
-        error_code in = receive_data(client_fd, &data, &bytes_received, &finished);
-    
-        if (in == ERROR_SOCKET_DISCONNECT || in == END_SIGNAL) 
-            break;
-        else if (in == SUCCESS)
-        {
-            printf(KYEL"\nRecibe [%ld B] Client %s (FD: %d)\n"KDEF, bytes_received, client_type_to_string[CLIENT_TYPE_A], client_fd);
+        snprintf(result, sizeof(result), "Failed to run command: %s", strerror(errno));
 
-            result = journalctl_execute(data, client_fd);
+        bytes_sent = strlen(result) + 1;
 
-            bytes_sent = strlen(result) + 1;
-            
-            if(send_data(client_fd, result, bytes_sent, &finished) == SUCCESS)
-                printf(KCYN"\nSend [%ld B] Client %s (FD: %d)\n"KDEF, bytes_sent, client_type_to_string[CLIENT_TYPE_A], client_fd);
-            else
-                fprintf(stderr, KRED"\nError sending data to client %s (FD: %d) \n"KDEF, client_type_to_string[CLIENT_TYPE_A], client_fd);
+        if (channel < 0)
+            out = send_data(client_fd, result, bytes_sent, &finished);
+        else
+            out = channel_send(client_fd, (uint32_t) channel, result, bytes_sent, &finished);
+    }
+    else
+    {
+        if (channel < 0)
+            out = send_stream(client_fd, journalctl_read, &stream, &bytes_sent, &finished);
+        else
+            out = channel_send_stream(client_fd, (uint32_t) channel, journalctl_read, &stream, &bytes_sent, &finished);
 
-            free(result);
-        }
+        journalctl_close(&stream);
+    }
+
+    if(out == SUCCESS)
+    {
+        handler_account(handler, 0, bytes_sent);
+        printf(KCYN"\nSend [%ld B] Client %s (FD: %d)\n"KDEF, bytes_sent, client_type_to_string[type], client_fd);
     }
+    else
+        fprintf(stderr, KRED"\nError sending data to client %s (FD: %d) \n"KDEF, client_type_to_string[type], client_fd);
 }
 
-void client_b_handle(int client_fd)
+void command_run(command_task *task)
 {
-    char* data = NULL;
-    char* result = NULL;
+    client_session* session = task->session;
+    client_type type = (client_type) session->type;
+    char* command = task->command;
 
-    while (1)
+    while (command)
     {
-        size_t bytes_received;
-        size_t bytes_sent;
+        journalctl_send(session->client_fd, task->channel, type, command, type == CLIENT_TYPE_B, session->handler);
 
-        error_code in = receive_data(client_fd, &data, &bytes_received, &finished);
-    
-        if (in == ERROR_SOCKET_DISCONNECT || in == END_SIGNAL) 
+        free(command);
+
+        if (task->channel < 0)
             break;
-        else if (in == SUCCESS)
+
+        channel_request* request = &session->requests[task->channel];
+        int release = 0;
+
+        pthread_mutex_lock(&session->lock);
+
+        // The next request of the channel arrived before this one was over
+        if (request->queued && !session->closing)
+        {
+            command = request->command;
+
+            request->command = NULL;
+            request->command_size = 0;
+        }
+        else
         {
-            FILE *fp;
-            char filename[256];
+            command = NULL;
+
+            request->active = 0;
+            release = --session->commands == 0 && session->closing;
+        }
 
-            printf(KYEL"\nRecibe [%ld B] Client %s (FD: %d)\n"KDEF, bytes_received, client_type_to_string[CLIENT_TYPE_B], client_fd);
+        request->queued = 0;
 
-            sprintf(filename, "%s_%d.txt.gz", COMPRESS_TMP_OUTPUT, client_fd);
+        pthread_mutex_unlock(&session->lock);
 
-            result = journalctl_execute(data, client_fd);
+        // The session ended while this command ran and left its release to us
+        if (release)
+            session_release(session);
+    }
+
+    if (task->channel < 0)
+        session_resume(session, SUCCESS);
+}
 
-            compress_and_save_data(result, filename);
+void *command_thread(void *args)
+{
+    command_task* task = (command_task*) args;
 
-            free(result);
+    command_run(task);
 
-            fp = fopen(filename, "rb");
+    free(task);
 
-            fseek(fp, 0L, SEEK_END);
-            bytes_sent = (size_t) ftell(fp);
-            fseek(fp, 0L, SEEK_SET);
+    pthread_mutex_lock(&mutex);
 
-            result = calloc(bytes_sent, sizeof(char));
+    if (--server.commands == 0)
+        pthread_cond_broadcast(&commands_done);
 
-            fread(result, sizeof(char), bytes_sent, fp);
+    pthread_mutex_unlock(&mutex);
 
-            if(send_data(client_fd, result, bytes_sent, &finished) == SUCCESS)
-                printf(KCYN"\nSend [%ld B] Client %s (FD: %d)\n"KDEF, bytes_sent, client_type_to_string[CLIENT_TYPE_B], client_fd);
-            else
-                fprintf(stderr, KRED"\nError sending data to client %s (FD: %d) \n"KDEF, client_type_to_string[CLIENT_TYPE_B], client_fd);
-            
-            free(result);
-            fclose(fp);
-            remove(filename);
+    return NULL;
+}
+
+void command_start(client_session *session, int channel, char *command)
+{
+    command_task local = { .session = session, .channel = channel, .command = command };
+    command_task* task = malloc(sizeof(command_task));
+    pthread_t tid;
+    int created = 0;
+
+    if (task)
+    {
+        *task = local;
+
+        pthread_mutex_lock(&mutex);
+
+        // Once the server ends, end() waits for the command threads started so far
+        if (!finished && pthread_create(&tid, NULL, command_thread, task) == 0)
+        {
+            pthread_detach(tid);
+            server.commands++;
+            created = 1;
         }
+
+        pthread_mutex_unlock(&mutex);
+    }
+
+    if (created)
+        return;
+
+    free(task);
+
+    command_run(&local);
+}
+
+error_code client_channel_receive(client_session *session)
+{
+    uint32_t channel;
+    char* data;
+    size_t size;
+    int last;
+    error_code result = channel_receive(session->client_fd, &channel, &data, &size, &last, &finished);
+
+    if (result != SUCCESS)
+        return result;
+
+    channel_request* request = &session->requests[channel];
+
+    pthread_mutex_lock(&session->lock);
+
+    int queued = request->queued;
+
+    pthread_mutex_unlock(&session->lock);
+
+    // A channel carries one request after the other, so at most one waits for the running one
+    if (queued)
+    {
+        free(data);
+        return ERROR_SOCKET_RECEIVE;
+    }
+
+    char* command = realloc(request->command, request->command_size + size + 1);
+
+    if (!command)
+    {
+        free(data);
+        return ERROR_SOCKET_RECEIVE;
+    }
+
+    memcpy(command + request->command_size, data, size + 1);
+
+    request->command = command;
+    request->command_size += size;
+
+    free(data);
+
+    handler_account(session->handler, size, 0);
+
+    if (!last)
+        return SUCCESS;
+
+    printf(KYEL"\nRecibe [%ld B] Client %s (FD: %d) channel %u\n"KDEF, request->command_size, client_type_to_string[session->type], session->client_fd, channel);
+
+    pthread_mutex_lock(&session->lock);
+
+    // The command thread of the channel takes it once its answer was sent
+    if (request->active)
+    {
+        request->queued = 1;
+        command = NULL;
+    }
+    else
+    {
+        request->active = 1;
+        session->commands++;
+
+        request->command = NULL;
+        request->command_size = 0;
+    }
+
+    pthread_mutex_unlock(&session->lock);
+
+    if (command)
+        command_start(session, (int) channel, command);
+
+    return SUCCESS;
+}
+
+void client_channels_finish(channel_request *requests)
+{
+    for (uint32_t i = 0; i < CONNECTION_MAX_CHANNELS; i++)
+        free(requests[i].command);
+}
+
+void client_channels_handle(client_session *session)
+{
+    if ((session->requests = calloc(CONNECTION_MAX_CHANNELS, sizeof(channel_request))) == NULL)
+        return;
+
+    while (client_channel_receive(session) == SUCCESS);
+}
+
+error_code client_request_receive(int client_fd, client_type type, int handler, char **command)
+{
+    size_t bytes_received;
+
+    error_code in = receive_data(client_fd, command, &bytes_received, &finished);
+
+    if (in != SUCCESS)
+        return in;
+
+    handler_account(handler, bytes_received, 0);
+
+    printf(KYEL"\nRecibe [%ld B] Client %s (FD: %d)\n"KDEF, bytes_received, client_type_to_string[type], client_fd);
+
+    return SUCCESS;
+}
+
+error_code client_request_handle(int client_fd, client_type type, int handler)
+{
+    char* data = NULL;
+
+    error_code in = client_request_receive(client_fd, type, handler, &data);
+
+    if (in != SUCCESS)
+        return in;
+
+    journalctl_send(client_fd, -1, type, data, type == CLIENT_TYPE_B, handler);
+
+    free(data);
+
+    return SUCCESS;
+}
+
+void client_a_handle(client_session *session)
+{
+    if (channel_count(session->client_fd))
+    {
+        client_channels_handle(session);
+        return;
+    }
+
+    while (client_request_handle(session->client_fd, CLIENT_TYPE_A, session->handler) == SUCCESS);
+}
+
+void client_b_handle(client_session *session)
+{
+    if (channel_count(session->client_fd))
+    {
+        client_channels_handle(session);
+        return;
     }
+
+    while (client_request_handle(session->client_fd, CLIENT_TYPE_B, session->handler) == SUCCESS);
 }
 
-void client_c_handle(int client_fd)
+void client_c_handle(int client_fd, int handler)
 {
     char* result = get_system_info();
 
     size_t bytes_sent = strlen(result) + 1;
 
     if(send_data(client_fd, result, bytes_sent, &finished) == SUCCESS)
+    {
+        handler_account(handler, 0, bytes_sent);
         printf(KCYN"\nSend [%ld B] Client %s (FD: %d)\n"KDEF, bytes_sent, client_type_to_string[CLIENT_TYPE_C], client_fd);
+    }
     else
         fprintf(stderr, KRED"\nError sending data to client %s (FD: %d) \n"KDEF, client_type_to_string[CLIENT_TYPE_C], client_fd);
 
     free(result);
 }
 
-void *connection_handler(void *args) 
-{    
-    int *client_fd = (int*)args; 
+void session_timeout_set(int client_fd, int seconds)
+{
+    struct timeval timeout = { .tv_sec = seconds, .tv_usec = 0 };
+
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+void session_create(int client_fd)
+{
+    client_session* session = calloc(1, sizeof(client_session));
+
+    if (!session)
+    {
+        close(client_fd);
+        return;
+    }
+
+    session->client_fd = client_fd;
+    session->type = -1;
+
+    pthread_mutex_init(&session->lock, NULL);
+
+    // Idle clients wait in the event loop, only a stalled message runs into the timeout
+    session_timeout_set(client_fd, server.io_timeout);
+
+    if ((session->handler = handler_create(client_fd, session)) < 0)
+    {
+        close(client_fd);
+        pthread_mutex_destroy(&session->lock);
+        free(session);
+        return;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = session };
+
+    // From here on the session may be served by a worker already
+    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, client_fd, &event) != 0)
+        session_end(session);
+}
+
+void session_end(client_session *session)
+{
+    pthread_mutex_lock(&session->lock);
+
+    session->closing = 1;
+
+    int commands = session->commands;
 
-    int type = connection_start(*client_fd);
+    pthread_mutex_unlock(&session->lock);
 
-    if (type < 0)
+    // Hanging up stops the commands still answering, the last one releases the session
+    if (commands)
     {
-        close(*client_fd);
-        free(args);
+        shutdown(session->client_fd, SHUT_RDWR);
+        return;
+    }
+
+    session_release(session);
+}
 
-        return NULL;
+void session_release(client_session *session)
+{
+    if (session->requests)
+    {
+        client_channels_finish(session->requests);
+        free(session->requests);
     }
 
-    switch ((client_type)type)
+    if (session->type >= 0)
+        connection_end(session->client_fd, (client_type) session->type);
+    else
     {
-    case CLIENT_TYPE_A:
-        client_a_handle(*client_fd);
-        break;
-    
-    case CLIENT_TYPE_B:
-        client_b_handle(*client_fd);
-        break;
+        connection_release(session->client_fd);
+        close(session->client_fd);
+    }
 
-    case CLIENT_TYPE_C:
-        client_c_handle(*client_fd);
-        break;
-    
-    default:
-        break;
+    handler_destroy(session->handler);
+
+    pthread_mutex_destroy(&session->lock);
+
+    free(session);
+}
+
+void session_close(handler *h, void *args)
+{
+    client_session* session = (client_session*) h->context;
+
+    UNUSED(args);
+
+    printf(KBLU"\nClient %s (FD: %d) open for %ld s, %lu B received, %lu B sent\n"KDEF, h->type >= 0 ? client_type_to_string[h->type] : "-",
+           h->client_fd, (long) (time(NULL) - h->start), h->bytes_received, h->bytes_sent);
+
+    session_end(session);
+}
+
+void session_dispatch(client_session *session)
+{
+    if (pool_submit(&server.pool, session_handler, session) != SUCCESS)
+    {
+        fprintf(stderr, KRED"\nFail to queue client (FD: %d)\n"KDEF, session->client_fd);
+        session_end(session);
     }
+}
+
+void session_thread_start(client_session *session)
+{
+    handler* h = handler_get(session->handler);
+
+    // The thread waits for its client between requests too
+    session_timeout_set(session->client_fd, 0);
+
+    pthread_mutex_lock(&mutex);
 
-    connection_end(client_fd, type);
+    // Once the server ends, end() joins the threads started so far
+    int created = !finished && pthread_create(&h->tid, NULL, session_thread, session) == 0;
+
+    h->thread = created;
+
+    pthread_mutex_unlock(&mutex);
+
+    if (!created)
+        session_end(session);
+}
+
+void *session_thread(void *args)
+{
+    client_session* session = (client_session*) args;
+
+    if (session->type == CLIENT_TYPE_A)
+        client_a_handle(session);
+    else
+        client_b_handle(session);
+
+    pthread_mutex_lock(&mutex);
+
+    // Once the server ends, end() joins this thread and ends the session
+    if (!finished)
+    {
+        handler_get(session->handler)->thread = 0;
+        pthread_detach(pthread_self());
+        session_end(session);
+    }
+
+    pthread_mutex_unlock(&mutex);
 
     return NULL;
 }
 
+void session_handler(void *args)
+{
+    client_session* session = (client_session*) args;
+    int client_fd = session->client_fd;
+    error_code result = SUCCESS;
+
+    if (session->type < 0)
+    {
+        session->type = connection_start(client_fd);
+
+        __atomic_store_n(&handler_get(session->handler)->type, session->type, __ATOMIC_RELAXED);
+
+        if (session->type < 0)
+            result = ERROR_SOCKET_CONNECTION;
+        else if (session->type == CLIENT_TYPE_C)
+        {
+            client_c_handle(client_fd, session->handler);
+            result = END_SIGNAL;
+        }
+        else if (!connection_pollable(client_fd))
+        {
+            // Rings and io_uring receives do not show on the socket, these connections get a thread of their own
+            session_thread_start(session);
+            return;
+        }
+        else if (channel_count(client_fd) && (session->requests = calloc(CONNECTION_MAX_CHANNELS, sizeof(channel_request))) == NULL)
+            result = ERROR_SOCKET_CONNECTION;
+    }
+    else if (session->requests)
+        result = client_channel_receive(session);
+    else
+    {
+        char* command = NULL;
+
+        // The answer is streamed by a thread of its own, which gives the session back afterwards
+        if ((result = client_request_receive(client_fd, (client_type) session->type, session->handler, &command)) == SUCCESS)
+        {
+            command_start(session, -1, command);
+            return;
+        }
+    }
+
+    session_resume(session, result);
+}
+
+void session_resume(client_session *session, error_code result)
+{
+    int client_fd = session->client_fd;
+
+    // A request read ahead with the previous one does not make the socket readable again, it waits behind the other sessions
+    if (result == SUCCESS && !finished && connection_idle(client_fd))
+    {
+        if (pool_submit(&server.pool, session_handler, session) == SUCCESS)
+            return;
+
+        result = ERROR_THREAD_FAILED;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = session };
+
+    // Back to the event loop until the next request, the session is not ours anymore
+    if (result != SUCCESS || finished || epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, client_fd, &event) != 0)
+        session_end(session);
+}
+
 int connection_start(int client_fd)
 {
     char* buffer = NULL;
+    char* offer_text;
     client_type type;
     error_code result = receive_data(client_fd, &buffer, NULL, &finished);
     
@@ -179,24 +567,56 @@ int connection_start(int client_fd)
         return -1;
     }
 
+    if (type < CLIENT_TYPE_A || type > CLIENT_TYPE_C)
+    {
+        fprintf(stderr, KRED"Fail client connection, bad client type\n"KDEF);
+        free(buffer);
+        return -1;
+    }
+
+    if ((offer_text = strchr(buffer, ASCII_SPACE)) != NULL)
+    {
+        connection_options offer, local, agreed;
+        char reply[CONNECTION_OPTIONS_SIZE];
+
+        connection_options_legacy(&offer);
+        connection_options_default(client_fd, &local);
+
+        connection_options_parse(offer_text, &offer);
+        connection_options_negotiate(&offer, &local, &agreed);
+
+        connection_options_format(&agreed, reply, sizeof(reply));
+
+        if (send_data(client_fd, reply, strlen(reply) + 1, &finished) != SUCCESS)
+        {
+            fprintf(stderr, KRED"Fail client connection, handshake not completed\n"KDEF);
+            free(buffer);
+            return -1;
+        }
+
+        connection_configure(client_fd, &agreed);
+
+        if (agreed.transport == TRANSPORT_RING && connection_ring_create(client_fd) != SUCCESS)
+        {
+            fprintf(stderr, KRED"Fail client connection, shared memory not created\n"KDEF);
+            free(buffer);
+            return -1;
+        }
+    }
+
+    free(buffer);
+
     printf(KGRN"\nClient %s (FD: %d) connect !\n"KDEF, client_type_to_string[type], client_fd);
 
     return type;
 }
 
-void connection_end(int *client_fd, client_type type)
+void connection_end(int client_fd, client_type type)
 {
-    printf(KRED"\nClient %s (FD: %d) disconnect !\n"KDEF, client_type_to_string[type], *client_fd);
+    printf(KRED"\nClient %s (FD: %d) disconnect !\n"KDEF, client_type_to_string[type], client_fd);
     
-    close(*client_fd);
-    free(client_fd);
-
-    if(!finished)
-    {
-        pthread_mutex_lock(&mutex);
-        handler_destroy(pthread_self());
-        pthread_mutex_unlock(&mutex);
-    }
+    connection_release(client_fd);
+    close(client_fd);
 }
 
 error_code create_unix_socket(const char *socket_path)
@@ -204,7 +624,7 @@ error_code create_unix_socket(const char *socket_path)
     struct sockaddr_un server_address;
 
     server.unix_socket_path = strdup(socket_path);
-    server.unix_socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    server.unix_socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
     if (server.unix_socket_fd < 0) 
     {
@@ -224,7 +644,7 @@ error_code create_unix_socket(const char *socket_path)
         return ERROR_SOCKET_BIND;
     }
 
-    if (listen(server.unix_socket_fd, 1) < 0) 
+    if (listen(server.unix_socket_fd, server.backlog) < 0) 
     {
         perror("listen() failed");
         return ERROR_SOCKET_LISTEN;
@@ -233,31 +653,40 @@ error_code create_unix_socket(const char *socket_path)
     return SUCCESS;
 }
 
-error_code create_ipv4_socket(const uint16_t socket_port)
+error_code create_ipv4_socket(const uint16_t socket_port, int *socket_fd)
 {
     struct sockaddr_in server_address;
+    int enable = 1;
 
-    server.ipv4_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    *socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
-    if (server.ipv4_socket_fd < 0) 
+    if (*socket_fd < 0) 
     {
         perror("socket() failed");
         return ERROR_SOCKET_CREATION;
     }
 
+    // Every acceptor binds the port, the kernel spreads the connections among them
+    if (setsockopt(*socket_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+        setsockopt(*socket_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+    {
+        perror("setsockopt() failed");
+        return ERROR_SOCKET_CREATION;
+    }
+
     memset(&server_address, 0, sizeof(server_address));
 
     server_address.sin_family = AF_INET;
     server_address.sin_addr.s_addr = INADDR_ANY;
     server_address.sin_port = htons(socket_port);
 
-    if (bind(server.ipv4_socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) 
+    if (bind(*socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) 
     {
         perror("bind() failed");
         return ERROR_SOCKET_BIND;
     }
 
-    if (listen(server.ipv4_socket_fd, 1) < 0) 
+    if (listen(*socket_fd, server.backlog) < 0) 
     {
         perror("listen() failed");
         return ERROR_SOCKET_LISTEN;
@@ -266,31 +695,40 @@ error_code create_ipv4_socket(const uint16_t socket_port)
     return SUCCESS;
 }
 
-error_code create_ipv6_socket(const uint16_t socket_port)
+error_code create_ipv6_socket(const uint16_t socket_port, int *socket_fd)
 {
     struct sockaddr_in6 server_address;
+    int enable = 1;
 
-    server.ipv6_socket_fd = socket(AF_INET6, SOCK_STREAM, 0);
+    *socket_fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
-    if (server.ipv6_socket_fd < 0) 
+    if (*socket_fd < 0) 
     {
         perror("socket() failed");
         return ERROR_SOCKET_CREATION;
     }
 
+    // Every acceptor binds the port, the kernel spreads the connections among them
+    if (setsockopt(*socket_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+        setsockopt(*socket_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+    {
+        perror("setsockopt() failed");
+        return ERROR_SOCKET_CREATION;
+    }
+
     memset(&server_address, 0, sizeof(server_address));
 
     server_address.sin6_family = AF_INET6;
     server_address.sin6_addr = in6addr_any;
     server_address.sin6_port = htons(socket_port);
 
-    if (bind(server.ipv6_socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) 
+    if (bind(*socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) 
     {
         perror("bind() failed");
         return ERROR_SOCKET_BIND;
     }
 
-    if (listen(server.ipv6_socket_fd, 1) < 0) 
+    if (listen(*socket_fd, server.backlog) < 0) 
     {
         perror("listen() failed");
         return ERROR_SOCKET_LISTEN;
@@ -300,44 +738,231 @@ error_code create_ipv6_socket(const uint16_t socket_port)
 }
 
 
-error_code accept_connection(int *client_fd)
+void accept_pending_ring(void)
 {
-    *client_fd = -1;
+    // Listening sockets indexed by the user data of their accepts
+    int listeners[3] = { server.ipv4_socket_fd, server.ipv6_socket_fd, server.unix_socket_fd };
+    uint64_t listener;
+    int32_t res;
+    uint32_t flags;
 
-    while (*client_fd < 0 && !finished)
+    // Readable with an empty completion ring: completions overflowed
+    if (!uring_ready(&server.accept_ring))
+        uring_submit(&server.accept_ring, 0);
+
+    while (uring_next(&server.accept_ring, &listener, &res, &flags))
     {
-        struct timeval timeout = {0, 100000};
-        fd_set socket_set;
-        int max_socket;
+        // Accepts stop after errors (EMFILE and the like), start them again
+        if (!(flags & URING_CQE_MORE) && listener < 3 && uring_prep_accept_multishot(&server.accept_ring, listeners[listener], listener) == 0)
+            uring_submit(&server.accept_ring, 0);
 
-        FD_ZERO(&socket_set);
+        if (res >= 0)
+            session_create(res);
+    }
+}
 
-        FD_SET(server.ipv4_socket_fd, &socket_set);
-        FD_SET(server.ipv6_socket_fd, &socket_set);
-        FD_SET(server.unix_socket_fd, &socket_set);
+void accept_pending(int listen_fd)
+{
+    int client_fd;
 
-        max_socket = (server.ipv4_socket_fd > server.ipv6_socket_fd) ? server.ipv4_socket_fd : server.ipv6_socket_fd;
-        max_socket = (server.unix_socket_fd > max_socket) ? server.unix_socket_fd : max_socket;
+    // Listening sockets do not block, take every client waiting. Clients are served with blocking calls
+    while ((client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0 || errno == EINTR)
+        if (client_fd >= 0)
+            session_create(client_fd);
+}
 
-        if (select(max_socket + 1, &socket_set, NULL, NULL, &timeout) > 0)
+void *acceptor_handler(void *args)
+{
+    acceptor* a = (acceptor*) args;
+    struct pollfd fds[3] =
+    {
+        { .fd = a->ipv4_socket_fd, .events = POLLIN },
+        { .fd = a->ipv6_socket_fd, .events = POLLIN },
+        { .fd = communication_wakeup_fd(), .events = POLLIN }
+    };
+
+    while (!finished)
+    {
+        // Blocks until a client connects or a signal wakes the server up
+        if (poll(fds, 3, -1) < 0 && errno != EINTR)
         {
-            if (FD_ISSET(server.ipv4_socket_fd, &socket_set))
-                *client_fd = accept(server.ipv4_socket_fd, NULL, NULL);
+            perror("poll() failed");
+            break;
+        }
+
+        if (fds[0].revents && !finished)
+            accept_pending(a->ipv4_socket_fd);
+
+        if (fds[1].revents && !finished)
+            accept_pending(a->ipv6_socket_fd);
+    }
+
+    return NULL;
+}
+
+uint32_t acceptor_default_count(void)
+{
+    const char* acceptors = getenv("IPC_ACCEPTORS");
+    long count;
+
+    if (acceptors && (count = strtol(acceptors, NULL, 10)) >= 1)
+        return count > SERVER_MAX_ACCEPTORS ? SERVER_MAX_ACCEPTORS : (uint32_t) count;
+
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (count < 1)
+        return 1;
+
+    return count > SERVER_MAX_ACCEPTORS ? SERVER_MAX_ACCEPTORS : (uint32_t) count;
+}
+
+int server_backlog(void)
+{
+    const char* backlog = getenv("IPC_BACKLOG");
+    long size;
+
+    if (backlog && (size = strtol(backlog, NULL, 10)) >= 1)
+        return size > INT32_MAX ? INT32_MAX : (int) size;
+
+    return SERVER_BACKLOG;
+}
+
+int server_io_timeout(void)
+{
+    const char* timeout = getenv("IPC_IO_TIMEOUT");
+    long seconds;
+
+    if (timeout && (seconds = strtol(timeout, NULL, 10)) >= 0)
+        return seconds > INT32_MAX ? INT32_MAX : (int) seconds;
+
+    return SERVER_IO_TIMEOUT;
+}
+
+error_code acceptors_start(uint32_t count)
+{
+    server.acceptor_count = 0;
+
+    // The event loop is the first acceptor
+    if (count <= 1)
+        return SUCCESS;
+
+    if ((server.acceptors = calloc(count - 1, sizeof(acceptor))) == NULL)
+        return ERROR_THREAD_FAILED;
+
+    for (uint32_t i = 0; i < count - 1; i++)
+    {
+        acceptor* a = &server.acceptors[i];
+        int listeners[2] = { -1, -1 };
+        error_code result = create_ipv4_socket(IPV4_SOCKET_PORT, &listeners[0]);
+
+        if (result == SUCCESS)
+            result = create_ipv6_socket(IPV6_SOCKET_PORT, &listeners[1]);
+
+        for (int j = 0; j < 2 && result == SUCCESS; j++)
+            if (fcntl(listeners[j], F_SETFL, fcntl(listeners[j], F_GETFL) | O_NONBLOCK) != 0)
+                result = ERROR_SOCKET_CREATION;
 
-            if (FD_ISSET(server.ipv6_socket_fd, &socket_set))
-                *client_fd = accept(server.ipv6_socket_fd, NULL, NULL);
+        a->ipv4_socket_fd = listeners[0];
+        a->ipv6_socket_fd = listeners[1];
+
+        if (result == SUCCESS && pthread_create(&a->tid, NULL, acceptor_handler, a) != 0)
+            result = ERROR_THREAD_FAILED;
+
+        if (result != SUCCESS)
+        {
+            for (int j = 0; j < 2; j++)
+                if (listeners[j] >= 0)
+                    close(listeners[j]);
 
-            if (FD_ISSET(server.unix_socket_fd, &socket_set))
-                *client_fd = accept(server.unix_socket_fd, NULL, NULL);
+            return result;
         }
+
+        server.acceptor_count++;
+    }
+
+    return SUCCESS;
+}
+
+void acceptors_stop(void)
+{
+    for (int i = 0; i < server.acceptor_count; i++)
+    {
+        pthread_join(server.acceptors[i].tid, NULL);
+
+        close(server.acceptors[i].ipv4_socket_fd);
+        close(server.acceptors[i].ipv6_socket_fd);
+    }
+
+    free(server.acceptors);
+
+    server.acceptors = NULL;
+    server.acceptor_count = 0;
+}
+
+error_code event_loop_init(void)
+{
+    int listeners[3] = { server.ipv4_socket_fd, server.ipv6_socket_fd, server.unix_socket_fd };
+    struct epoll_event event = { .events = EPOLLIN };
+
+    if ((server.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return ERROR_SOCKET_CREATION;
+
+    event.data.ptr = &wakeup_source;
+
+    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, communication_wakeup_fd(), &event) != 0)
+        return ERROR_SOCKET_CREATION;
+
+    if (server.accept_ring.fd >= 0)
+    {
+        event.data.ptr = &server.accept_ring;
+
+        return epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.accept_ring.fd, &event) == 0 ? SUCCESS : ERROR_SOCKET_CREATION;
     }
 
-    if(finished)
-        return END_SIGNAL;
+    for (int i = 0; i < 3; i++)
+    {
+        event.data.ptr = i == 0 ? &server.ipv4_socket_fd : i == 1 ? &server.ipv6_socket_fd : &server.unix_socket_fd;
+
+        if (fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) | O_NONBLOCK) != 0 ||
+            epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listeners[i], &event) != 0)
+            return ERROR_SOCKET_CREATION;
+    }
 
     return SUCCESS;
 }
 
+void event_loop(void)
+{
+    struct epoll_event events[EVENT_LOOP_EVENTS];
+
+    while (!finished)
+    {
+        // Blocks until a client connects, a request arrives or a signal wakes the server up
+        int count = epoll_wait(server.epoll_fd, events, EVENT_LOOP_EVENTS, -1);
+
+        if (count < 0 && errno != EINTR)
+        {
+            perror("epoll_wait() failed");
+            break;
+        }
+
+        for (int i = 0; i < count && !finished; i++)
+        {
+            void* source = events[i].data.ptr;
+
+            if (source == &wakeup_source)
+                continue;
+
+            if (source == &server.accept_ring)
+                accept_pending_ring();
+            else if (source == &server.ipv4_socket_fd || source == &server.ipv6_socket_fd || source == &server.unix_socket_fd)
+                accept_pending(*(int*) source);
+            else
+                session_dispatch((client_session*) source);
+        }
+    }
+}
+
 void init(void)
 {
     struct stat st = {0};
@@ -351,6 +976,9 @@ void init(void)
         }
     }
 
+    server.backlog = server_backlog();
+    server.io_timeout = server_io_timeout();
+
     error_code result = create_unix_socket(UNIX_SOCKET_PATH);
 
     if (result != SUCCESS) 
@@ -359,7 +987,7 @@ void init(void)
         exit(EXIT_FAILURE);
     }
 
-    result = create_ipv4_socket(IPV4_SOCKET_PORT);
+    result = create_ipv4_socket(IPV4_SOCKET_PORT, &server.ipv4_socket_fd);
 
     if (result != SUCCESS)
     {
@@ -367,7 +995,7 @@ void init(void)
         exit(EXIT_FAILURE);
     }
 
-    result = create_ipv6_socket(IPV6_SOCKET_PORT);
+    result = create_ipv6_socket(IPV6_SOCKET_PORT, &server.ipv6_socket_fd);
 
     if (result != SUCCESS)
     {
@@ -375,18 +1003,84 @@ void init(void)
         exit(EXIT_FAILURE);
     }
 
+    server.accept_ring.fd = -1;
+
+    // One submission arms the accepts of every listening socket
+    if (uring_enabled() && uring_init(&server.accept_ring, 16) == 0)
+    {
+        if (uring_prep_accept_multishot(&server.accept_ring, server.ipv4_socket_fd, 0) != 0 ||
+            uring_prep_accept_multishot(&server.accept_ring, server.ipv6_socket_fd, 1) != 0 ||
+            uring_prep_accept_multishot(&server.accept_ring, server.unix_socket_fd, 2) != 0 ||
+            uring_submit(&server.accept_ring, 0) != 0)
+            uring_exit(&server.accept_ring);
+    }
+
+    if (pool_init(&server.pool, pool_default_size()) != SUCCESS)
+    {
+        fprintf(stderr, "Error: could not start the worker threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (event_loop_init() != SUCCESS)
+    {
+        perror("epoll setup failed");
+        exit(EXIT_FAILURE);
+    }
+
     signal_handler_init();
 
     pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&commands_done, NULL);
+
+    if (acceptors_start(acceptor_default_count()) != SUCCESS)
+    {
+        fprintf(stderr, "Error: could not start the acceptor threads\n");
+        exit(EXIT_FAILURE);
+    }
 
-    printf(KBLU"\nServer start (FD: %d) !\n"KDEF, server.unix_socket_fd);
+    printf(KBLU"\nServer start (FD: %d, %u workers, %d acceptors) !\n"KDEF, server.unix_socket_fd, server.pool.count, server.acceptor_count + 1);
 }
 
 void end(void)
 {
+    // No client is accepted from here on
+    acceptors_stop();
+
+    // Threads that saw the server running are done with their sessions
+    pthread_mutex_lock(&mutex);
+    pthread_mutex_unlock(&mutex);
+
     handler_wait_all();
+
+    pthread_mutex_lock(&mutex);
+
+    // Commands stop their child once they see the server finished, they may still give their session back to the pool
+    while (server.commands)
+        pthread_cond_wait(&commands_done, &mutex);
+
+    pthread_mutex_unlock(&mutex);
+
+    pool_stats stats;
+
+    // Queued tasks run (and see the server finished) before the workers stop
+    pool_stats_get(&server.pool, &stats);
+    pool_destroy(&server.pool);
+
+    printf(KBLU"\nWorkers: %u, tasks: %lu run of %lu queued, %lu stolen, most queued on a worker: %zu\n"KDEF,
+           stats.workers, stats.executed, stats.submitted, stats.stolen, stats.depth_max);
+
+    printf(KBLU"\nConnections open: %d\n"KDEF, handler_count());
+
+    // Idle sessions were left to the event loop, session threads left theirs to us
+    handler_foreach(session_close, NULL);
+
     handler_destroy_all();
 
+    close(server.epoll_fd);
+
+    if (server.accept_ring.fd >= 0)
+        uring_exit(&server.accept_ring);
+
     close(server.unix_socket_fd);
     close(server.ipv4_socket_fd);
     close(server.ipv6_socket_fd);
@@ -395,6 +1089,7 @@ void end(void)
     
     free(server.unix_socket_path);
 
+    pthread_cond_destroy(&commands_done);
     pthread_mutex_destroy(&mutex);
 
     rmdir("tmp");
@@ -408,28 +1103,7 @@ int main(void)
 {
     init();
 
-    int *client_fd = calloc(1, sizeof(int));   
-    
-    error_code result;
-
-    do 
-    {
-        result = accept_connection(client_fd);
-
-        if(result == SUCCESS)
-        {
-            pthread_t* tid = handler_create();
-
-            if (pthread_create(tid, NULL, connection_handler, (void *)client_fd) != 0)
-            {
-                perror("pthread_create() failed");
-                close(*client_fd);
-                free(client_fd);
-            }
-
-            client_fd = calloc(1, sizeof(int));
-        }
-    } while(result != END_SIGNAL);
+    event_loop();
 
     end();
 
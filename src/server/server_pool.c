@@ -0,0 +1,282 @@
+#include "server_pool.h"
+
+// Pool of the calling thread, NULL outside pool workers
+static _Thread_local worker_pool* current_pool = NULL;
+
+// Worker of the calling thread
+static _Thread_local pool_worker* current_worker = NULL;
+
+/**
+ * @brief Append a task to a worker queue, doubling the ring when full
+ *
+ * @param worker Worker
+ * @param task Task
+ * @return int 0 if queued, -1 if out of memory
+ */
+static int queue_push(pool_worker *worker, const pool_task *task)
+{
+    pthread_mutex_lock(&worker->lock);
+
+    size_t depth = worker->tail - worker->head;
+
+    if (depth == worker->capacity)
+    {
+        pool_task* tasks = malloc(2 * worker->capacity * sizeof(pool_task));
+
+        if (!tasks)
+        {
+            pthread_mutex_unlock(&worker->lock);
+            return -1;
+        }
+
+        for (size_t i = 0; i < depth; i++)
+            tasks[i] = worker->tasks[(worker->head + i) & (worker->capacity - 1)];
+
+        free(worker->tasks);
+
+        worker->tasks = tasks;
+        worker->capacity *= 2;
+        worker->head = 0;
+        worker->tail = depth;
+    }
+
+    worker->tasks[worker->tail++ & (worker->capacity - 1)] = *task;
+
+    if (depth + 1 > worker->depth_max)
+        worker->depth_max = depth + 1;
+
+    pthread_mutex_unlock(&worker->lock);
+
+    return 0;
+}
+
+/**
+ * @brief Take a task from a worker queue: the oldest one for the worker
+ *        itself, the newest one for a thief
+ *
+ * @param worker Worker
+ * @param task Task taken
+ * @param steal 1 if the caller is another worker
+ * @return int 1 if a task was taken, 0 if the queue is empty
+ */
+static int queue_take(pool_worker *worker, pool_task *task, int steal)
+{
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->head == worker->tail)
+    {
+        pthread_mutex_unlock(&worker->lock);
+        return 0;
+    }
+
+    if (steal)
+        *task = worker->tasks[--worker->tail & (worker->capacity - 1)];
+    else
+        *task = worker->tasks[worker->head++ & (worker->capacity - 1)];
+
+    pthread_mutex_unlock(&worker->lock);
+
+    return 1;
+}
+
+/**
+ * @brief Take the next task for the calling worker, from its own queue or
+ *        else from the others
+ *
+ * @param pool Pool
+ * @param task Task taken
+ * @return int 1 if a task was taken, 0 if every queue is empty
+ */
+static int pool_take(worker_pool *pool, pool_task *task)
+{
+    pool_worker* self = current_worker;
+    int taken = queue_take(self, task, 0);
+
+    for (uint32_t i = 1; !taken && i < pool->count; i++)
+    {
+        if ((taken = queue_take(&pool->workers[(self->index + i) % pool->count], task, 1)))
+            __atomic_fetch_add(&self->stolen, 1, __ATOMIC_RELAXED);
+    }
+
+    if (taken)
+        __atomic_fetch_sub(&pool->pending, 1, __ATOMIC_RELAXED);
+
+    return taken;
+}
+
+/**
+ * @brief Run a task on the calling worker
+ *
+ * @param task Task
+ */
+static void pool_run(const pool_task *task)
+{
+    task->run(task->args);
+
+    __atomic_fetch_add(&current_worker->executed, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Worker thread: run tasks until the pool stops and the queues are
+ *        empty, sleeping while there is nothing to do
+ *
+ * @param args Worker (pool_worker)
+ */
+static void *pool_worker_main(void *args)
+{
+    pool_worker* worker = (pool_worker*) args;
+    worker_pool* pool = worker->pool;
+    pool_task task;
+    int exit = 0;
+
+    current_pool = pool;
+    current_worker = worker;
+
+    while (!exit)
+    {
+        if (pool_take(pool, &task))
+        {
+            pool_run(&task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+
+        // Pending counts tasks before they are queued, so a submission never finds every worker asleep
+        while (!__atomic_load_n(&pool->pending, __ATOMIC_RELAXED) && !pool->stop)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+
+        exit = pool->stop && !__atomic_load_n(&pool->pending, __ATOMIC_RELAXED);
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+uint32_t pool_default_size(void)
+{
+    const char* workers = getenv("IPC_WORKERS");
+    long count;
+
+    if (workers && (count = strtol(workers, NULL, 10)) >= 1)
+        return count > POOL_MAX_WORKERS ? POOL_MAX_WORKERS : (uint32_t) count;
+
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (count < 1)
+        return 1;
+
+    return count > POOL_MAX_WORKERS ? POOL_MAX_WORKERS : (uint32_t) count;
+}
+
+error_code pool_init(worker_pool *pool, uint32_t workers)
+{
+    memset(pool, 0, sizeof(worker_pool));
+
+    if (workers < 1 || workers > POOL_MAX_WORKERS || (pool->workers = calloc(workers, sizeof(pool_worker))) == NULL)
+        return ERROR_THREAD_FAILED;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (uint32_t i = 0; i < workers; i++)
+    {
+        pool_worker* worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->index = i;
+        worker->capacity = POOL_QUEUE_SIZE;
+
+        pthread_mutex_init(&worker->lock, NULL);
+
+        if ((worker->tasks = malloc(POOL_QUEUE_SIZE * sizeof(pool_task))) == NULL ||
+            pthread_create(&worker->tid, NULL, pool_worker_main, worker) != 0)
+        {
+            free(worker->tasks);
+            pthread_mutex_destroy(&worker->lock);
+
+            pool_destroy(pool);
+
+            return ERROR_THREAD_FAILED;
+        }
+
+        pool->count++;
+    }
+
+    return SUCCESS;
+}
+
+error_code pool_submit(worker_pool *pool, void (*run)(void*), void *args)
+{
+    pool_task task = { .run = run, .args = args };
+    pool_worker* worker = current_pool == pool ? current_worker : &pool->workers[__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->count];
+
+    __atomic_fetch_add(&pool->pending, 1, __ATOMIC_RELAXED);
+
+    if (queue_push(worker, &task) != 0)
+    {
+        __atomic_fetch_sub(&pool->pending, 1, __ATOMIC_RELAXED);
+        return ERROR_THREAD_FAILED;
+    }
+
+    __atomic_fetch_add(&pool->submitted, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    return SUCCESS;
+}
+
+void pool_stats_get(worker_pool *pool, pool_stats *stats)
+{
+    memset(stats, 0, sizeof(pool_stats));
+
+    stats->workers = pool->count;
+    stats->submitted = __atomic_load_n(&pool->submitted, __ATOMIC_RELAXED);
+
+    for (uint32_t i = 0; i < pool->count; i++)
+    {
+        pool_worker* worker = &pool->workers[i];
+
+        pthread_mutex_lock(&worker->lock);
+
+        stats->depth += worker->tail - worker->head;
+
+        if (worker->depth_max > stats->depth_max)
+            stats->depth_max = worker->depth_max;
+
+        pthread_mutex_unlock(&worker->lock);
+
+        stats->executed += __atomic_load_n(&worker->executed, __ATOMIC_RELAXED);
+        stats->stolen += __atomic_load_n(&worker->stolen, __ATOMIC_RELAXED);
+    }
+}
+
+void pool_destroy(worker_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->count; i++)
+        pthread_join(pool->workers[i].tid, NULL);
+
+    for (uint32_t i = 0; i < pool->count; i++)
+    {
+        free(pool->workers[i].tasks);
+        pthread_mutex_destroy(&pool->workers[i].lock);
+    }
+
+    free(pool->workers);
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+
+    pool->workers = NULL;
+    pool->count = 0;
+}
@@ -1,104 +1,157 @@
 #include "server_threads_handle.h"
 
-/**
- * @brief Handle thread node
- * 
- */
-struct th_node
-{
-    pthread_t tid;          // Thread id
-    struct th_node *next;   // Next handle thread
-};
+// Handler slots, in chunks that stay in place once allocated
+static handler* handler_chunks[HANDLER_CHUNKS];
+
+// Slots handed out so far, readers visit these
+static int handler_slots = 0;
+
+// First free slot, -1 if none
+static int handler_free = -1;
+
+// Handlers registered
+static int handler_live = 0;
 
-// First handle thread
-struct th_node *first_handler = NULL;
+// Mutex for slot allocation, readers do not take it
+static pthread_mutex_t handler_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-pthread_t* handler_create(void)
+int handler_create(int client_fd, void *context)
 {
-    struct th_node* last_th = handler_get_last();
-    struct th_node* new = calloc(1, sizeof(struct th_node));
+    pthread_mutex_lock(&handler_mutex);
 
-    new->next = NULL;
-    
-    if(!last_th)
-        first_handler = new;
+    int id = handler_free;
+
+    if (id >= 0)
+        handler_free = handler_get(id)->next_free;
     else
-        last_th->next = new;
+    {
+        id = handler_slots;
+
+        if (id >= HANDLER_CHUNK_SIZE * HANDLER_CHUNKS)
+        {
+            pthread_mutex_unlock(&handler_mutex);
+            return -1;
+        }
+
+        if (!handler_chunks[id / HANDLER_CHUNK_SIZE])
+        {
+            handler* chunk = calloc(HANDLER_CHUNK_SIZE, sizeof(handler));
+
+            if (!chunk)
+            {
+                pthread_mutex_unlock(&handler_mutex);
+                return -1;
+            }
 
-    return &new->tid;
+            __atomic_store_n(&handler_chunks[id / HANDLER_CHUNK_SIZE], chunk, __ATOMIC_RELEASE);
+        }
+
+        __atomic_store_n(&handler_slots, id + 1, __ATOMIC_RELEASE);
+    }
+
+    handler* h = handler_get(id);
+
+    h->client_fd = client_fd;
+    h->type = -1;
+    h->start = time(NULL);
+    h->bytes_received = 0;
+    h->bytes_sent = 0;
+    h->thread = 0;
+    h->context = context;
+    h->next_free = -1;
+
+    // Readers see the slot once it is filled
+    __atomic_store_n(&h->used, 1, __ATOMIC_RELEASE);
+
+    __atomic_fetch_add(&handler_live, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&handler_mutex);
+
+    return id;
 }
 
-void handler_destroy(pthread_t tid)
+handler* handler_get(int id)
 {
-    if (!first_handler)
-        return;
-    
-    struct th_node *th = handler_get_by_tid(tid);
+    return &__atomic_load_n(&handler_chunks[id / HANDLER_CHUNK_SIZE], __ATOMIC_ACQUIRE)[id % HANDLER_CHUNK_SIZE];
+}
 
-    if (!th)
-        return;
+void handler_destroy(int id)
+{
+    handler* h = handler_get(id);
 
-    struct th_node *parent = handler_get_parent(th);
+    pthread_mutex_lock(&handler_mutex);
 
-    if(!parent)
-        first_handler = th->next;
-    else if (!th->next)
-        parent->next = NULL;  
-    else 
-        parent->next = th->next;
+    __atomic_store_n(&h->used, 0, __ATOMIC_RELEASE);
 
-    free(th);
+    h->next_free = handler_free;
+    handler_free = id;
+
+    __atomic_fetch_sub(&handler_live, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&handler_mutex);
 }
 
-void handler_destroy_all(void)
+void handler_account(int id, size_t received, size_t sent)
 {
-    struct th_node* it = first_handler;
+    handler* h = handler_get(id);
 
-    while (it)
-    {
-        struct th_node* aux = it;
-        it = it->next;
-        free(aux);
-    }
+    __atomic_fetch_add(&h->bytes_received, received, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->bytes_sent, sent, __ATOMIC_RELAXED);
 }
 
-struct th_node* handler_get_last(void) 
+int handler_count(void)
 {
-    struct th_node* last_th = first_handler;
+    return __atomic_load_n(&handler_live, __ATOMIC_RELAXED);
+}
 
-    if(!last_th)
-        return NULL;
-    
-    while (last_th->next)
-        last_th = last_th->next;
+void handler_foreach(void (*visit)(handler*, void*), void *args)
+{
+    int slots = __atomic_load_n(&handler_slots, __ATOMIC_ACQUIRE);
 
-    return last_th;
+    for (int id = 0; id < slots; id++)
+    {
+        handler* h = handler_get(id);
+
+        if (__atomic_load_n(&h->used, __ATOMIC_ACQUIRE))
+            visit(h, args);
+    }
 }
 
-struct th_node* handler_get_by_tid(pthread_t tid)
+void handler_destroy_all(void)
 {
-    for (struct th_node* th = first_handler; th; th = th->next) 
-        if (th->tid == tid) 
-            return th;
+    pthread_mutex_lock(&handler_mutex);
+
+    for (int i = 0; i < HANDLER_CHUNKS; i++)
+    {
+        free(handler_chunks[i]);
+        handler_chunks[i] = NULL;
+    }
+
+    handler_slots = 0;
+    handler_free = -1;
+    handler_live = 0;
 
-    return NULL;
+    pthread_mutex_unlock(&handler_mutex);
 }
 
-struct th_node* handler_get_parent(struct th_node* th)
+/**
+ * @brief Join the thread of a handler, if it has one
+ *
+ * @param h Handler
+ * @param args Unused
+ */
+static void handler_join(handler *h, void *args)
 {
-    struct th_node *parent = first_handler;
-
-    if(!parent || th == parent)
-        return NULL;
+    UNUSED(args);
 
-    while (parent->next != th)
-        parent = parent->next;
-    
-    return parent;
+    if (h->thread)
+    {
+        pthread_join(h->tid, NULL);
+        h->thread = 0;
+    }
 }
 
 void handler_wait_all(void)
 {
-    for (struct th_node* th = first_handler; th; th = th->next)
-        pthread_join(th->tid, NULL);
+    handler_foreach(handler_join, NULL);
 }
\ No newline at end of file
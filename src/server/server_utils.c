@@ -1,3 +1,6 @@
+// pipe2, environ, POLLRDHUP
+#define _GNU_SOURCE
+
 #include "server_utils.h"
 
 char* get_system_info(void) 
@@ -50,103 +53,319 @@ char* get_system_info(void)
     return load_str;
 }
 
-int compress_and_save_data(const char *data, const char* filename)
+int journalctl_open(journalctl_stream *stream, const char *command, int compress, int client_fd, volatile sig_atomic_t *end_flag)
 {
-    FILE *file;
-    gzFile gzfile;
-    size_t length = strlen(data);
-    size_t status;
+    char prompt[1024];
+    int output[2], error[2];
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+
+    memset(stream, 0, sizeof(journalctl_stream));
+
+    stream->pid = -1;
+    stream->output_fd = -1;
+    stream->error_fd = -1;
+    stream->compress = compress;
+    stream->client_fd = client_fd;
+    stream->end_flag = end_flag;
 
-    file = fopen(filename, "wb");
+    snprintf(prompt, sizeof(prompt), "journalctl %s", command);
 
-    if (!file) 
+    char* argv[] = { "sh", "-c", prompt, NULL };
+
+    if (compress && deflateInit2(&stream->gzip, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
         return -1;
-    
-    gzfile = gzdopen(fileno(file), "wb");
 
-    if (!gzfile) 
+    // Close on exec, so commands spawned at the same time do not keep each other's pipes open
+    if (pipe2(output, O_CLOEXEC) != 0)
     {
-        fclose(file);
+        if (compress)
+            deflateEnd(&stream->gzip);
+
         return -1;
     }
 
-    status = (size_t) gzwrite(gzfile, data, (unsigned int) length);
+    if (pipe2(error, O_CLOEXEC) != 0)
+    {
+        close(output[0]);
+        close(output[1]);
+
+        if (compress)
+            deflateEnd(&stream->gzip);
 
-    if (status != length) {
-        gzclose(gzfile);
-        fclose(file);
         return -1;
     }
 
-    gzclose(gzfile);
-    fclose(file);
+    posix_spawn_file_actions_init(&actions);
+
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, error[1], STDERR_FILENO);
+
+    // Own process group, so journalctl is stopped along with the shell
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+
+    int result = posix_spawn(&stream->pid, JOURNAL_SHELL, &actions, &attributes, argv, environ);
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(output[1]);
+    close(error[1]);
+
+    if (result != 0)
+    {
+        close(output[0]);
+        close(error[0]);
+
+        if (compress)
+            deflateEnd(&stream->gzip);
+
+        errno = result;
+
+        return -1;
+    }
+
+    stream->output_fd = output[0];
+    stream->error_fd = error[0];
+
+    fcntl(stream->output_fd, F_SETFL, fcntl(stream->output_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(stream->error_fd, F_SETFL, fcntl(stream->error_fd, F_GETFL) | O_NONBLOCK);
 
     return 0;
 }
 
-char* journalctl_execute(const char* command, int client_fd)
+/**
+ * @brief Keep what the command wrote to its standard error, up to
+ *        JOURNAL_ERROR_SIZE bytes
+ * 
+ * @param stream Stream
+ * @param scratch Buffer for the bytes beyond the limit
+ * @param size Scratch buffer size
+ * @return int 0 if success, -1 if error
+ */
+static int journalctl_read_error(journalctl_stream *stream, char *scratch, size_t size)
 {
-    FILE *fp;
-    char* result;
+    char* buffer = scratch;
+    ssize_t length;
 
-    char prompt[1024];
-    char file_output[128];
-    char file_err[128];
-       
-    sprintf(file_output, "%s_%d.log", JOURNAL_TMP_OUTPUT, client_fd);
-    sprintf(file_err, "%s_%d.log", JOURNAL_TMP_ERROR, client_fd);
+    if (stream->error_size < JOURNAL_ERROR_SIZE)
+    {
+        if (!stream->error && (stream->error = malloc(JOURNAL_ERROR_SIZE)) == NULL)
+            return -1;
+
+        buffer = stream->error + stream->error_size;
+        size = JOURNAL_ERROR_SIZE - stream->error_size;
+    }
+
+    while ((length = read(stream->error_fd, buffer, size)) < 0 && errno == EINTR);
+
+    if (length < 0)
+        return errno == EAGAIN ? 0 : -1;
+
+    if (length == 0)
+    {
+        close(stream->error_fd);
+        stream->error_fd = -1;
+    }
+    else if (buffer != scratch)
+        stream->error_size += (size_t) length;
 
-    sprintf(prompt, "journalctl %s > %s 2> %s", command, file_output, file_err);
+    return 0;
+}
 
-    fp = popen(prompt, "r");
+/**
+ * @brief Read the next bytes of standard output as they arrive, collecting
+ *        standard error meanwhile so the command never blocks on it
+ * 
+ * @param stream Stream
+ * @param buffer Output buffer
+ * @param size Output buffer size
+ * @return ssize_t Bytes read, 0 once both pipes ended, -1 if error or end
+ *         flag set
+ */
+static ssize_t journalctl_read_output(journalctl_stream *stream, char *buffer, size_t size)
+{
+    int wakeup_fd = stream->end_flag ? communication_wakeup_fd() : -1;
 
-    if (fp == NULL) 
+    while (stream->output_fd >= 0 || stream->error_fd >= 0)
     {
-        result = calloc(strlen(strerror(errno)) + 27, sizeof(char));
-        sprintf(result, "Failed to run command: %s", strerror(errno));
-        return result;
+        if (stream->end_flag && *stream->end_flag)
+            return -1;
+
+        // Closed pipes (-1) are left out by poll, requests waiting on the client socket are not taken
+        struct pollfd fds[4] =
+        {
+            { .fd = stream->output_fd, .events = POLLIN },
+            { .fd = stream->error_fd, .events = POLLIN },
+            { .fd = wakeup_fd, .events = POLLIN },
+            { .fd = stream->client_fd, .events = POLLRDHUP }
+        };
+
+        if (poll(fds, 4, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        // Nobody left to answer
+        if (fds[3].revents)
+            return -1;
+
+        // Woken up for an end flag other than ours, stop watching
+        if (fds[2].revents && !*stream->end_flag)
+            wakeup_fd = -1;
+
+        if (fds[1].revents && journalctl_read_error(stream, buffer, size) != 0)
+            return -1;
+
+        if (!fds[0].revents)
+            continue;
+
+        ssize_t length = read(stream->output_fd, buffer, size);
+
+        if (length > 0)
+            return length;
+
+        if (length == 0)
+        {
+            close(stream->output_fd);
+            stream->output_fd = -1;
+        }
+        else if (errno != EAGAIN && errno != EINTR)
+            return -1;
     }
 
-    pclose(fp);
+    return 0;
+}
+
+/**
+ * @brief Read the next bytes of the uncompressed journalctl output
+ * 
+ * @param stream Stream
+ * @param buffer Output buffer
+ * @param size Output buffer size
+ * @return ssize_t Bytes read, 0 at the end, -1 if error
+ */
+static ssize_t journalctl_read_raw(journalctl_stream *stream, char *buffer, size_t size)
+{
+    while (1)
+    {
+        ssize_t length;
+
+        switch (stream->source)
+        {
+        case JOURNAL_OUTPUT:
+            length = journalctl_read_output(stream, buffer, size);
+
+            if (length != 0)
+            {
+                if (length > 0)
+                    stream->output_size += (size_t) length;
+
+                return length;
+            }
+
+            waitpid(stream->pid, NULL, 0);
+            stream->pid = -1;
+
+            if (stream->output_size == 0)
+                stream->source = JOURNAL_ERROR;
+            else
+                stream->source = stream->compress ? JOURNAL_END : JOURNAL_TERMINATOR;
+
+            break;
+
+        case JOURNAL_ERROR:
+            length = (ssize_t) (stream->error_size - stream->error_sent < size ? stream->error_size - stream->error_sent : size);
 
-    if((result = read_file(file_err)) == NULL)
-        if((result = read_file(file_output)) == NULL)
-            result = NULL;
+            if (length != 0)
+            {
+                memcpy(buffer, stream->error + stream->error_sent, (size_t) length);
+                stream->error_sent += (size_t) length;
 
-    remove(file_err);
-    remove(file_output);
+                return length;
+            }
 
-    return result;
+            stream->source = stream->compress ? JOURNAL_END : JOURNAL_TERMINATOR;
+
+            break;
+
+        case JOURNAL_TERMINATOR:
+            buffer[0] = '\0';
+            stream->source = JOURNAL_END;
+
+            return 1;
+
+        default:
+            return 0;
+        }
+    }
 }
 
-char* read_file(const char* file)
+ssize_t journalctl_read(void *context, char *buffer, size_t size)
 {
-    FILE *fp = fopen(file, "r");
-    unsigned long size;
-    char* result;
+    journalctl_stream *stream = (journalctl_stream*) context;
 
-    if (fp == NULL)
-        return NULL;
+    if (!stream->compress)
+        return journalctl_read_raw(stream, buffer, size);
 
-    fseek(fp, 0, SEEK_END);
+    if (stream->gzip_done)
+        return 0;
 
-    size = (unsigned long) ftell(fp);
+    stream->gzip.next_out = (Bytef*) buffer;
+    stream->gzip.avail_out = (uInt) size;
 
-    if(size < 1)
+    while (stream->gzip.avail_out == size)
     {
-        fclose(fp);
-        return NULL;
+        if (stream->gzip.avail_in == 0 && !stream->input_done)
+        {
+            ssize_t length = journalctl_read_raw(stream, (char*) stream->input, JOURNAL_CHUNK_SIZE);
+
+            if (length < 0)
+                return -1;
+
+            stream->input_done = length == 0;
+            stream->gzip.next_in = stream->input;
+            stream->gzip.avail_in = (uInt) length;
+        }
+
+        int status = deflate(&stream->gzip, stream->input_done ? Z_FINISH : Z_NO_FLUSH);
+
+        if (status == Z_STREAM_END)
+        {
+            stream->gzip_done = 1;
+            break;
+        }
+
+        if (status != Z_OK && status != Z_BUF_ERROR)
+            return -1;
     }
 
-    rewind(fp);
+    return (ssize_t) (size - stream->gzip.avail_out);
+}
 
-    result = calloc(size, sizeof(char));
+void journalctl_close(journalctl_stream *stream)
+{
+    if (stream->output_fd >= 0)
+        close(stream->output_fd);
 
-    fread(result, 1, size, fp);
+    if (stream->error_fd >= 0)
+        close(stream->error_fd);
 
-    result[size - 1] = '\0';
+    // A command cut short may not write again (journalctl -f), so it would never get SIGPIPE
+    if (stream->pid > 0 && waitpid(stream->pid, NULL, WNOHANG) == 0)
+    {
+        kill(-stream->pid, SIGTERM);
+        waitpid(stream->pid, NULL, 0);
+    }
 
-    fclose(fp);
+    free(stream->error);
 
-    return result;
-}
\ No newline at end of file
+    if (stream->compress)
+        deflateEnd(&stream->gzip);
+}
@@ -0,0 +1,445 @@
+#include "uring.h"
+
+#ifdef IPC_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+// Runtime availability of io_uring, probed once
+static int uring_available = 0;
+
+// Probe initialization control
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Check whether the kernel lets us create an io_uring instance
+ *        (it may be disabled by io_uring_disabled or seccomp)
+ *
+ */
+static void uring_probe(void)
+{
+    const char* backend = getenv("IPC_IO");
+    uring u;
+
+    if (!backend || strcmp(backend, "uring") != 0)
+        return;
+
+    if (uring_init(&u, 2) == 0)
+    {
+        uring_available = 1;
+        uring_exit(&u);
+    }
+}
+
+int uring_enabled(void)
+{
+    pthread_once(&uring_once, uring_probe);
+
+    return uring_available;
+}
+
+int uring_init(uring *u, uint32_t entries)
+{
+    struct io_uring_params params;
+
+    memset(u, 0, sizeof(uring));
+    memset(&params, 0, sizeof(params));
+
+    // Keep submitting the rest of a batch when an entry fails
+    params.flags = IORING_SETUP_SUBMIT_ALL;
+
+    u->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+
+    if (u->fd < 0 && errno == EINVAL)
+    {
+        params.flags = 0;
+        u->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    }
+
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_memory_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    u->cq_memory_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cq_memory_size > u->sq_memory_size)
+            u->sq_memory_size = u->cq_memory_size;
+
+        u->cq_memory_size = u->sq_memory_size;
+    }
+
+    u->sq_memory = mmap(NULL, u->sq_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+
+    if (u->sq_memory == MAP_FAILED)
+    {
+        u->sq_memory = NULL;
+        uring_exit(u);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        u->cq_memory = u->sq_memory;
+    else if ((u->cq_memory = mmap(NULL, u->cq_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    {
+        u->cq_memory = NULL;
+        uring_exit(u);
+        return -1;
+    }
+
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+    if (u->sqes == MAP_FAILED)
+    {
+        u->sqes = NULL;
+        uring_exit(u);
+        return -1;
+    }
+
+    u->sq_head = (uint32_t*) ((char*) u->sq_memory + params.sq_off.head);
+    u->sq_tail = (uint32_t*) ((char*) u->sq_memory + params.sq_off.tail);
+    u->sq_array = (uint32_t*) ((char*) u->sq_memory + params.sq_off.array);
+    u->sq_mask = *(uint32_t*) ((char*) u->sq_memory + params.sq_off.ring_mask);
+    u->sq_entries = params.sq_entries;
+    u->cq_head = (uint32_t*) ((char*) u->cq_memory + params.cq_off.head);
+    u->cq_tail = (uint32_t*) ((char*) u->cq_memory + params.cq_off.tail);
+    u->cqes = (char*) u->cq_memory + params.cq_off.cqes;
+    u->cq_mask = *(uint32_t*) ((char*) u->cq_memory + params.cq_off.ring_mask);
+
+    // Submission entries always sit at the index of their slot
+    for (uint32_t i = 0; i < u->sq_entries; i++)
+        u->sq_array[i] = i;
+
+    return 0;
+}
+
+void uring_exit(uring *u)
+{
+    if (u->buffer_ring)
+        munmap(u->buffer_ring, u->buffer_count * sizeof(struct io_uring_buf));
+
+    if (u->buffers)
+        munmap(u->buffers, (size_t) u->buffer_count * u->buffer_size);
+
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+
+    if (u->cq_memory && u->cq_memory != u->sq_memory)
+        munmap(u->cq_memory, u->cq_memory_size);
+
+    if (u->sq_memory)
+        munmap(u->sq_memory, u->sq_memory_size);
+
+    if (u->fd >= 0)
+        close(u->fd);
+
+    memset(u, 0, sizeof(uring));
+    u->fd = -1;
+}
+
+int uring_buffers_init(uring *u, uint16_t group, uint32_t count, uint32_t size)
+{
+    struct io_uring_buf_reg reg;
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+
+    u->buffer_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buffers = mmap(NULL, (size_t) count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buffer_count = count;
+    u->buffer_size = size;
+    u->buffer_tail = 0;
+
+    if (u->buffer_ring == MAP_FAILED || u->buffers == MAP_FAILED)
+    {
+        if (u->buffer_ring != MAP_FAILED)
+            munmap(u->buffer_ring, ring_size);
+
+        if (u->buffers != MAP_FAILED)
+            munmap(u->buffers, (size_t) count * size);
+
+        u->buffer_ring = NULL;
+        u->buffers = NULL;
+
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+
+    reg.ring_addr = (uint64_t) (uintptr_t) u->buffer_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        munmap(u->buffer_ring, ring_size);
+        munmap(u->buffers, (size_t) count * size);
+
+        u->buffer_ring = NULL;
+        u->buffers = NULL;
+
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        uring_buffer_recycle(u, (uint16_t) i);
+
+    return 0;
+}
+
+char* uring_buffer(const uring *u, uint16_t id)
+{
+    return u->buffers + (size_t) id * u->buffer_size;
+}
+
+void uring_buffer_recycle(uring *u, uint16_t id)
+{
+    struct io_uring_buf_ring* br = u->buffer_ring;
+    struct io_uring_buf* buf = &br->bufs[u->buffer_tail & (u->buffer_count - 1)];
+
+    buf->addr = (uint64_t) (uintptr_t) uring_buffer(u, id);
+    buf->len = u->buffer_size;
+    buf->bid = id;
+
+    u->buffer_tail++;
+
+    // The kernel may take the buffer as soon as it sees the new tail
+    __atomic_store_n(&br->tail, u->buffer_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get the next free submission entry, cleared
+ *
+ * @param u Instance
+ * @return struct io_uring_sqe* Entry, NULL if the submission ring is full
+ */
+static struct io_uring_sqe* uring_get_sqe(uring *u)
+{
+    uint32_t head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    uint32_t tail = *u->sq_tail;
+
+    if (tail - head >= u->sq_entries)
+        return NULL;
+
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*) u->sqes + (tail & u->sq_mask);
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    // The kernel reads the ring only when we enter it
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+
+    return sqe;
+}
+
+int uring_prep_sendmsg(uring *u, int sockect_fd, const struct msghdr *msg, int flags, int link, uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(u);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sockect_fd;
+    sqe->addr = (uint64_t) (uintptr_t) msg;
+    sqe->len = 1;
+    sqe->msg_flags = (uint32_t) flags;
+    sqe->user_data = user_data;
+
+    if (link)
+        sqe->flags = IOSQE_IO_LINK;
+
+    return 0;
+}
+
+int uring_prep_recv_multishot(uring *u, int sockect_fd, uint16_t group, uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(u);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sockect_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+int uring_prep_accept_multishot(uring *u, int sockect_fd, uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(u);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockect_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+int uring_submit(uring *u, uint32_t wait_nr)
+{
+    // A link must not run into entries queued by a later batch
+    if (u->queued)
+        ((struct io_uring_sqe*) u->sqes + ((*u->sq_tail - 1) & u->sq_mask))->flags &= (uint8_t) ~IOSQE_IO_LINK;
+
+    do
+    {
+        // GETEVENTS also moves completions that found the ring full back into it
+        long result = syscall(__NR_io_uring_enter, u->fd, u->queued, wait_nr, IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if (result < 0)
+        {
+            // Interrupted while waiting, the caller checks its completions again
+            if (errno == EINTR && wait_nr)
+                return 0;
+
+            if (errno == EINTR)
+                continue;
+
+            return -errno;
+        }
+
+        u->queued -= (uint32_t) result;
+
+        // Do not wait again for what a partial submission may never post
+        wait_nr = 0;
+    } 
+    while (u->queued > 0);
+
+    return 0;
+}
+
+int uring_next(uring *u, uint64_t *user_data, int32_t *res, uint32_t *flags)
+{
+    uint32_t head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    struct io_uring_cqe* cqe = (struct io_uring_cqe*) u->cqes + (head & u->cq_mask);
+
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    *flags = cqe->flags;
+
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+int uring_ready(const uring *u)
+{
+    return *u->cq_head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+#else
+
+int uring_enabled(void)
+{
+    return 0;
+}
+
+int uring_init(uring *u, uint32_t entries)
+{
+    UNUSED(entries);
+
+    memset(u, 0, sizeof(uring));
+    u->fd = -1;
+
+    return -1;
+}
+
+void uring_exit(uring *u)
+{
+    UNUSED(u);
+}
+
+int uring_buffers_init(uring *u, uint16_t group, uint32_t count, uint32_t size)
+{
+    UNUSED(u);
+    UNUSED(group);
+    UNUSED(count);
+    UNUSED(size);
+
+    return -1;
+}
+
+char* uring_buffer(const uring *u, uint16_t id)
+{
+    UNUSED(id);
+
+    return u->buffers;
+}
+
+void uring_buffer_recycle(uring *u, uint16_t id)
+{
+    UNUSED(u);
+    UNUSED(id);
+}
+
+int uring_prep_sendmsg(uring *u, int sockect_fd, const struct msghdr *msg, int flags, int link, uint64_t user_data)
+{
+    UNUSED(u);
+    UNUSED(sockect_fd);
+    UNUSED(msg);
+    UNUSED(flags);
+    UNUSED(link);
+    UNUSED(user_data);
+
+    return -1;
+}
+
+int uring_prep_recv_multishot(uring *u, int sockect_fd, uint16_t group, uint64_t user_data)
+{
+    UNUSED(u);
+    UNUSED(sockect_fd);
+    UNUSED(group);
+    UNUSED(user_data);
+
+    return -1;
+}
+
+int uring_prep_accept_multishot(uring *u, int sockect_fd, uint64_t user_data)
+{
+    UNUSED(u);
+    UNUSED(sockect_fd);
+    UNUSED(user_data);
+
+    return -1;
+}
+
+int uring_submit(uring *u, uint32_t wait_nr)
+{
+    UNUSED(u);
+    UNUSED(wait_nr);
+
+    return -ENOSYS;
+}
+
+int uring_next(uring *u, uint64_t *user_data, int32_t *res, uint32_t *flags)
+{
+    UNUSED(u);
+    UNUSED(user_data);
+    UNUSED(res);
+    UNUSED(flags);
+
+    return 0;
+}
+
+int uring_ready(const uring *u)
+{
+    UNUSED(u);
+
+    return 0;
+}
+
+#endif // IPC_IO_URING